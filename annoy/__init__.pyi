@@ -1,5 +1,5 @@
 
-from typing import Sized, overload
+from typing import Any, Callable, Sequence, Sized, overload
 from typing_extensions import Literal, Protocol
 
 class _Vector(Protocol, Sized):
@@ -7,9 +7,15 @@ class _Vector(Protocol, Sized):
 
 class AnnoyIndex:
     f: int
-    def __init__(self, f: int, metric: Literal["angular", "euclidean", "manhattan", "hamming", "dot"]) -> None: ...
+    def __init__(
+        self, f: int, metric: Literal["angular", "euclidean", "manhattan", "hamming", "dot"], max_leaf_size: int = ...
+    ) -> None: ...
     def load(self, fn: str, prefault: bool = ...) -> Literal[True]: ...
-    def save(self, fn: str, prefault: bool = ...) -> Literal[True]: ...
+    def prefault_async(self, n_jobs: int = ...) -> None: ...
+    def get_prefault_progress(self) -> float: ...
+    def wait_prefault(self) -> None: ...
+    def save(self, fn: str, prefault: bool = ..., reload: bool = ..., atomic: bool = ...) -> Literal[True]: ...
+    def save_to_fd(self, fd: int) -> Literal[True]: ...
     @overload
     def get_nns_by_item(self, i: int, n: int, search_k: int = ..., include_distances: Literal[False] = ...) -> list[int]: ...
     @overload
@@ -21,6 +27,14 @@ class AnnoyIndex:
         self, i: int, n: int, search_k: int = ..., *, include_distances: Literal[True]
     ) -> tuple[list[int], list[float]]: ...
     @overload
+    def get_nns_by_item(
+        self, i: int, n: int, search_k: int = ..., include_distances: Literal[False] = ..., *, as_memoryview: Literal[True]
+    ) -> memoryview: ...
+    @overload
+    def get_nns_by_item(
+        self, i: int, n: int, search_k: int = ..., *, include_distances: Literal[True], as_memoryview: Literal[True]
+    ) -> tuple[memoryview, memoryview]: ...
+    @overload
     def get_nns_by_vector(
         self, vector: _Vector, n: int, search_k: int = ..., include_distances: Literal[False] = ...
     ) -> list[int]: ...
@@ -32,14 +46,63 @@ class AnnoyIndex:
     def get_nns_by_vector(
         self, vector: _Vector, n: int, search_k: int = ..., *, include_distances: Literal[True]
     ) -> tuple[list[int], list[float]]: ...
-    def get_item_vector(self, __i: int) -> list[float]: ...
+    @overload
+    def get_nns_by_vector(
+        self, vector: _Vector, n: int, search_k: int = ..., include_distances: Literal[False] = ..., *,
+        as_memoryview: Literal[True]
+    ) -> memoryview: ...
+    @overload
+    def get_nns_by_vector(
+        self, vector: _Vector, n: int, search_k: int = ..., *, include_distances: Literal[True],
+        as_memoryview: Literal[True]
+    ) -> tuple[memoryview, memoryview]: ...
+    @overload
+    def get_nns_by_vector_batch(
+        self, vectors: Any, n: int, search_k: int = ..., include_distances: Literal[False] = ..., n_jobs: int = ...
+    ) -> memoryview: ...
+    @overload
+    def get_nns_by_vector_batch(
+        self, vectors: Any, n: int, search_k: int, include_distances: Literal[True], n_jobs: int = ...
+    ) -> tuple[memoryview, memoryview]: ...
+    @overload
+    def get_nns_by_vector_batch(
+        self, vectors: Any, n: int, search_k: int = ..., *, include_distances: Literal[True], n_jobs: int = ...
+    ) -> tuple[memoryview, memoryview]: ...
+    @overload
+    def get_item_vector(self, i: int, as_memoryview: Literal[False] = ...) -> list[float]: ...
+    @overload
+    def get_item_vector(self, i: int, as_memoryview: Literal[True]) -> memoryview: ...
+    @overload
+    def get_item_vector(self, i: int, as_memoryview: bool = ..., *, packed: Literal[True]) -> bytes: ...
+    def get_item_vectors(self) -> memoryview: ...
     def add_item(self, i: int, vector: _Vector) -> None: ...
+    def add_items(self, ids: Sequence[int], vectors: Any, n_jobs: int = ...) -> None: ...
+    def add_items_from_file(
+        self, fn: str, format: Literal["auto", "npy", "fvecs", "raw"] = ..., n_jobs: int = ...
+    ) -> None: ...
     def on_disk_build(self, fn: str) -> Literal[True]: ...
-    def build(self, n_trees: int, n_jobs: int = ...) -> Literal[True]: ...
+    def build(self, n_trees: int, n_jobs: int = ..., memory_budget: int = ...) -> Literal[True]: ...
+    def add_trees(self, n_trees: int, n_jobs: int = ...) -> Literal[True]: ...
+    def insert_item(self, i: int, vector: _Vector) -> None: ...
+    def mark_deleted(self, __i: int) -> None: ...
+    def compact(self) -> Literal[True]: ...
+    def merge(self, *indexes: AnnoyIndex) -> Literal[True]: ...
+    def merge_trees(self, *indexes: AnnoyIndex) -> Literal[True]: ...
     def unbuild(self) -> Literal[True]: ...
     def unload(self) -> Literal[True]: ...
     def get_distance(self, __i: int, __j: int) -> float: ...
     def get_n_items(self) -> int: ...
     def get_n_trees(self) -> int: ...
+    def get_max_leaf_size(self) -> int: ...
+    def set_projection(self, __n_components: int) -> None: ...
+    def get_projection(self) -> list[list[float]]: ...
+    def get_memory_usage(self) -> dict[str, int]: ...
+    def get_tree_stats(self, __tree: int) -> dict[str, Any]: ...
+    def get_candidate_stats(self, n_queries: int = ..., n: int = ..., search_k: int = ...) -> dict[str, float]: ...
     def verbose(self, __v: bool) -> Literal[True]: ...
     def set_seed(self, __s: int) -> None: ...
+    def set_split_sample_size(self, __n: int) -> None: ...
+    def set_out_of_core_memory(self, __memory: int) -> None: ...
+    def set_deterministic_build(self, __deterministic: bool = ...) -> None: ...
+    def set_build_callback(self, __callback: Callable[[dict[str, float]], Any] | None) -> None: ...
+    def cancel_build(self) -> None: ...
@@ -0,0 +1,225 @@
+# Copyright (c) 2013 Spotify AB
+#
+# Licensed under the Apache License, Version 2.0 (the "License"); you may not
+# use this file except in compliance with the License. You may obtain a copy of
+# the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+# WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+# License for the specific language governing permissions and limitations under
+# the License.
+
+# Prints the shape of the trees of an index, e.g.
+#   python -m annoy stats index.ann 40 angular
+# or builds an index from a file of vectors in several processes, e.g.
+#   python -m annoy build vectors.npy index.ann 40 angular --trees 100 --workers 8
+
+import argparse
+import json
+import multiprocessing
+import os
+import subprocess
+import sys
+import time
+
+from . import AnnoyIndex
+
+
+def _tree_summary(stats):
+    depths = stats["depths"]
+    n_leaves = stats["n_leaves"]
+    min_depth = next(d for d, c in enumerate(depths) if c)
+    mean_depth = sum(d * c for d, c in enumerate(depths)) / float(n_leaves)
+    mean_leaf_size = sum(k * c for k, c in enumerate(stats["leaf_sizes"])) / float(n_leaves)
+    return ("%d split nodes, %d leaves, depth %d-%d (mean %.1f), mean leaf size %.1f, "
+            "mean imbalance %.3f, %d random splits" % (
+                stats["n_split_nodes"], n_leaves, min_depth, len(depths) - 1, mean_depth,
+                mean_leaf_size, stats["mean_imbalance"], stats["n_random_splits"]))
+
+
+def stats(args):
+    index = AnnoyIndex(args.f, args.metric)
+    index.load(args.fn, prefault=False)
+    n_trees = index.get_n_trees()
+    trees = [index.get_tree_stats(t) for t in range(min(n_trees, args.trees or n_trees))]
+    candidates = index.get_candidate_stats(n_queries=args.queries, n=args.n, search_k=args.search_k)
+
+    if args.json:
+        json.dump({"n_items": index.get_n_items(), "n_trees": n_trees,
+                   "max_leaf_size": index.get_max_leaf_size(),
+                   "trees": trees, "candidates": candidates}, sys.stdout)
+        sys.stdout.write("\n")
+        return
+
+    print("%d items, %d trees, max leaf size %d" % (
+        index.get_n_items(), n_trees, index.get_max_leaf_size()))
+    for t, tree in enumerate(trees):
+        print("tree %d: %s" % (t, _tree_summary(tree)))
+    print("%d queries with n=%d: %d candidates, %d unique, %.1f%% duplicates" % (
+        candidates["n_queries"], args.n, candidates["n_candidates"], candidates["n_unique"],
+        100 * candidates["duplicate_rate"]))
+
+
+def _shard_sizes(n_trees, n_shards):
+    return [n_trees // n_shards + (k < n_trees % n_shards) for k in range(n_shards)]
+
+
+def _shard_seed(args, k):
+    # The threads of a worker use the seeds following its own, so the seeds of the shards are n_jobs apart
+    return args.seed + k * args.n_jobs
+
+
+def _limit_memory(memory):
+    # Caps the heap of a worker. The shard it builds into is mapped from its file, and doesn't count.
+    import resource
+    resource.setrlimit(resource.RLIMIT_DATA, (memory, memory))
+
+
+def build_shard(args):
+    # Builds the trees of one shard into a temporary file, which is renamed once it's complete,
+    # so that the file of a shard only exists if its worker finished.
+    tmp_fn = "%s.tmp%d" % (args.shard, os.getpid())
+    index = AnnoyIndex(args.f, args.metric, max_leaf_size=args.max_leaf_size)
+    index.set_seed(args.seed)
+    index.on_disk_build(tmp_fn)
+    try:
+        index.add_items_from_file(args.vectors, format=args.format, n_jobs=args.n_jobs)
+        index.build(args.trees, n_jobs=args.n_jobs)
+        index.unload()
+        os.rename(tmp_fn, args.shard)
+    except BaseException:
+        index.unload()
+        os.unlink(tmp_fn)
+        raise
+
+
+def build(args):
+    if args.trees < 1:
+        raise ValueError("The number of trees must be positive")
+    n_shards = min(args.shards or args.workers, args.trees)
+    shards = ["%s.shard%d" % (args.output, k) for k in range(n_shards)]
+    todo = [k for k in range(n_shards) if not (args.resume and os.path.exists(shards[k]))]
+    if len(todo) < n_shards:
+        print("reusing %d of %d shards" % (n_shards - len(todo), n_shards))
+
+    preexec_fn = None
+    if args.memory_limit:
+        preexec_fn = lambda: _limit_memory(args.memory_limit)
+    tries = dict((k, 0) for k in todo)
+    running = {}
+    while todo or running:
+        while todo and len(running) < args.workers:
+            k = todo.pop(0)
+            tries[k] += 1
+            cmd = [sys.executable, "-m", "annoy", "build-shard", args.vectors, shards[k], str(args.f), args.metric,
+                   "--trees", str(_shard_sizes(args.trees, n_shards)[k]), "--seed", str(_shard_seed(args, k)),
+                   "--format", args.format, "--max-leaf-size", str(args.max_leaf_size), "--n-jobs", str(args.n_jobs)]
+            running[k] = subprocess.Popen(cmd, preexec_fn=preexec_fn)
+        time.sleep(0.05)
+        for k, worker in list(running.items()):
+            code = worker.poll()
+            if code is None:
+                continue
+            del running[k]
+            tmp_fn = "%s.tmp%d" % (shards[k], worker.pid)
+            if os.path.exists(tmp_fn):
+                # Left behind by a worker that was killed
+                os.unlink(tmp_fn)
+            if code == 0:
+                print("built shard %d of %d" % (k + 1, n_shards))
+            elif tries[k] <= args.retries:
+                print("the worker of shard %d failed with exit code %d, retrying" % (k + 1, code))
+                todo.append(k)
+            else:
+                for other in running.values():
+                    other.kill()
+                    other.wait()
+                raise RuntimeError("The worker of shard %d failed %d times, last with exit code %d" % (
+                    k + 1, tries[k], code))
+
+    # The shards have the same items, so we only need to stitch their trees together. The first shard is
+    # copied to a temporary file, which the trees of the others are appended to, and which we then rename.
+    tmp_fn = "%s.tmp%d" % (args.output, os.getpid())
+    index = AnnoyIndex(args.f, args.metric, max_leaf_size=args.max_leaf_size)
+    index.load(shards[0], prefault=False)
+    try:
+        index.on_disk_build(tmp_fn)
+        for fn in shards[1:]:
+            other = AnnoyIndex(args.f, args.metric, max_leaf_size=args.max_leaf_size)
+            other.load(fn, prefault=False)
+            index.merge_trees(other)
+            other.unload()
+        n_items, n_trees = index.get_n_items(), index.get_n_trees()
+        index.unload()
+        os.rename(tmp_fn, args.output)
+    except BaseException:
+        index.unload()
+        if os.path.exists(tmp_fn):
+            os.unlink(tmp_fn)
+        raise
+    print("saved %d items and %d trees to %s" % (n_items, n_trees, args.output))
+    if not args.keep_shards:
+        for fn in shards:
+            os.unlink(fn)
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(prog="python -m annoy")
+    commands = parser.add_subparsers(dest="command")
+    commands.required = True
+
+    p = commands.add_parser("stats", help="print the depths, leaf sizes, split imbalance and "
+                            "random splits of each tree, and the duplicate candidates of sample queries")
+    p.add_argument("fn", help="index file")
+    p.add_argument("f", type=int, help="number of dimensions")
+    p.add_argument("metric", choices=["angular", "euclidean", "manhattan", "hamming", "dot"])
+    p.add_argument("--trees", type=int, default=0, help="only walk the first TREES trees")
+    p.add_argument("--queries", type=int, default=100, help="number of sample queries (default 100)")
+    p.add_argument("-n", type=int, default=10, help="neighbors per sample query (default 10)")
+    p.add_argument("--search-k", type=int, default=-1, help="search_k of the sample queries")
+    p.add_argument("--json", action="store_true", help="print all the numbers as JSON")
+    p.set_defaults(func=stats)
+
+    p = commands.add_parser("build", help="build an index from a file of vectors, with its trees split into "
+                            "shards that are built by separate worker processes and merged at the end")
+    p.add_argument("vectors", help="npy, fvecs or raw file of float32 vectors, see add_items_from_file")
+    p.add_argument("output", help="index file")
+    p.add_argument("f", type=int, help="number of dimensions")
+    p.add_argument("metric", choices=["angular", "euclidean", "manhattan", "hamming", "dot"])
+    p.add_argument("--trees", type=int, required=True, help="number of trees")
+    p.add_argument("--workers", type=int, default=multiprocessing.cpu_count(),
+                   help="worker processes running at the same time (default: the number of CPUs)")
+    p.add_argument("--shards", type=int, default=0,
+                   help="split the trees into this many shards, each built by one worker (default WORKERS)")
+    p.add_argument("--n-jobs", type=int, default=1, help="threads of each worker (default 1)")
+    p.add_argument("--memory-limit", type=int, default=0,
+                   help="bytes of heap each worker may allocate, not counting the mapped shard it builds")
+    p.add_argument("--retries", type=int, default=2, help="times to restart the worker of a shard that failed")
+    p.add_argument("--resume", action="store_true", help="reuse the shards that a previous run finished")
+    p.add_argument("--keep-shards", action="store_true", help="keep the shard files after merging them")
+    p.add_argument("--seed", type=int, default=0, help="seed of the first shard, the others use the next seeds after those of its N_JOBS threads")
+    p.add_argument("--format", default="auto", choices=["auto", "npy", "fvecs", "raw"])
+    p.add_argument("--max-leaf-size", type=int, default=0)
+    p.set_defaults(func=build)
+
+    p = commands.add_parser("build-shard", help="build the trees of one shard, run by the workers of build")
+    p.add_argument("vectors")
+    p.add_argument("shard")
+    p.add_argument("f", type=int)
+    p.add_argument("metric", choices=["angular", "euclidean", "manhattan", "hamming", "dot"])
+    p.add_argument("--trees", type=int, required=True)
+    p.add_argument("--seed", type=int, default=0)
+    p.add_argument("--format", default="auto")
+    p.add_argument("--max-leaf-size", type=int, default=0)
+    p.add_argument("--n-jobs", type=int, default=1)
+    p.set_defaults(func=build_shard)
+
+    args = parser.parse_args(argv)
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,5 +1,6 @@
 #!/bin/bash
 
+set -e
 
 echo "compiling precision example..."
 cmd="g++ precision_test.cpp -DANNOYLIB_MULTITHREADED_BUILD -o precision_test -std=c++14 -pthread"
@@ -10,6 +10,7 @@ class AnnoyVectorFloat {
     protected:
         float *ptr;
         int len;
+        int cap;
 
     public:
       ~AnnoyVectorFloat() {
@@ -28,12 +29,13 @@ class AnnoyVectorFloat {
         return ptr[i];
       };
       void fill_from_vector(vector<float>* v) {
-            if (ptr != NULL) {
-               free(ptr);
+            // Vectors that are reused for many queries only grow when they need to
+            if ((int)v->size() > cap) {
+                ptr = (float*) realloc(ptr, v->size() * sizeof(float));
+                cap = v->size();
             }
-            ptr = (float*) malloc(v->size() * sizeof(float));
-            for (int i = 0; i < v->size(); i++) {
-                ptr[i] = (float)(*v)[i];
+            if (!v->empty()) {
+                memcpy(ptr, &(*v)[0], v->size() * sizeof(float));
             }
             len = v->size();
       };
@@ -43,6 +45,7 @@ class AnnoyVectorInt {
     protected:
         int32_t *ptr;
         int len;
+        int cap;
 
     public:
       ~AnnoyVectorInt() {
@@ -61,12 +64,12 @@ class AnnoyVectorInt {
         return ptr[i];
       };
       void fill_from_vector(vector<int32_t>* v) {
-            if (ptr != NULL) {
-                free(ptr);
+            if ((int)v->size() > cap) {
+                ptr = (int32_t*) realloc(ptr, v->size() * sizeof(int32_t));
+                cap = v->size();
             }
-            ptr = (int32_t*) malloc(v->size() * sizeof(int32_t));
-            for (int i = 0; i < v->size(); i++) {
-                ptr[i] = (int32_t)(*v)[i];
+            if (!v->empty()) {
+                memcpy(ptr, &(*v)[0], v->size() * sizeof(int32_t));
             }
             len = v->size();
       };
@@ -145,6 +148,47 @@ class AnnoyIndex {
     delete result;
   };
 
+  // The *Into methods write the results right into the Go slices passed in, and return how many results
+  // there are, which is at most len(ids). distances can be nil, otherwise at most len(distances) results
+  // are written.
+  int getNnsByVectorInto(const float* w, int search_k, int32_t* ids, int ids_len, float* distances, int distances_len) {
+    int n = distances_len ? std::min(ids_len, distances_len) : ids_len;
+    ptr->get_nns_by_vectors(w, 1, n, search_k, ids, distances_len ? distances : NULL, 1);
+    int found = 0;
+    while (found < n && ids[found] != -1)
+      found++;
+    return found;
+  };
+  int getNnsByItemInto(int item, int search_k, int32_t* ids, int ids_len, float* distances, int distances_len) {
+    int n = distances_len ? std::min(ids_len, distances_len) : ids_len;
+    vector<int32_t> result;
+    vector<float> result_distances;
+    ptr->get_nns_by_item(item, n, search_k, &result, distances_len ? &result_distances : NULL);
+    if (!result.empty())
+      memcpy(ids, &result[0], result.size() * sizeof(int32_t));
+    if (!result_distances.empty())
+      memcpy(distances, &result_distances[0], result_distances.size() * sizeof(float));
+    return (int)result.size();
+  };
+  // Runs one query for every f floats in vectors with a single call from Go. Row q of ids (and of distances,
+  // unless it's nil) gets the n results of query q, padded with -1 (and NaN) if there are fewer. Returns
+  // false if the slices are too short.
+  bool getNnsByVectors(const float* vectors, int vectors_len, int n, int search_k, int32_t* ids, int ids_len, float* distances, int distances_len) {
+    if (n < 0 || vectors_len % this->f)
+      return false;
+    size_t n_results = (size_t)(vectors_len / this->f) * n;
+    if ((size_t)ids_len < n_results || (distances_len && (size_t)distances_len < n_results))
+      return false;
+    ptr->get_nns_by_vectors(vectors, vectors_len / this->f, n, search_k, ids, distances_len ? distances : NULL, 1);
+    return true;
+  };
+  bool getItemInto(int item, float* v, int v_len) {
+    if (v_len < this->f)
+      return false;
+    ptr->get_item(item, v);
+    return true;
+  };
+
   int getNItems() {
     return (int)ptr->get_n_items();
   };
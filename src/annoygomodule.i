@@ -11,15 +11,30 @@ namespace Annoy {}
 %typemap(gotype) (const float *)  "[]float32"
 %typemap(gotype) (int32_t)  "int32"
 
+// Go slices of numbers can be passed to C as they are, as long as C doesn't keep them
 %typemap(in) (const float *)
 %{
-    float *v;
-    vector<float> w;
-    v = (float *)$input.array;
-    for (int i = 0; i < $input.len; i++) {
-       w.push_back(v[i]);
-    }
-    $1 = &w[0];
+    $1 = (float *)$input.array;
+%}
+
+// The slices of the *Into methods and getNnsByVectors, which take their lengths too
+%typemap(gotype) (const float* vectors, int vectors_len) "[]float32"
+%typemap(in) (const float* vectors, int vectors_len)
+%{
+    $1 = (float *)$input.array;
+    $2 = (int)$input.len;
+%}
+%typemap(gotype) (int32_t* ids, int ids_len) "[]int32"
+%typemap(in) (int32_t* ids, int ids_len)
+%{
+    $1 = (int32_t *)$input.array;
+    $2 = (int)$input.len;
+%}
+%typemap(gotype) (float* distances, int distances_len), (float* v, int v_len) "[]float32"
+%typemap(in) (float* distances, int distances_len), (float* v, int v_len)
+%{
+    $1 = (float *)$input.array;
+    $2 = (int)$input.len;
 %}
 
 
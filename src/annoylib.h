@@ -26,6 +26,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <time.h>
 
 #if defined(_MSC_VER) && _MSC_VER == 1500
 typedef unsigned char     uint8_t;
@@ -65,7 +66,12 @@ typedef signed __int64    int64_t;
 #ifdef ANNOYLIB_MULTITHREADED_BUILD
 #include <thread>
 #include <mutex>
-#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
 #endif
 
 #ifdef _MSC_VER
@@ -95,6 +101,39 @@ typedef signed __int64    int64_t;
 // Compilers need *some* size defined for the v array, and some memory checking tools will flag for buffer overruns if this is set too low.
 #define ANNOYLIB_V_ARRAY_SIZE 65536
 
+// Indexes are written in chunks of at most this many bytes, which keeps every write() call bounded
+// and lets us stream an index through pipes and sockets.
+#ifndef ANNOYLIB_WRITE_CHUNK_SIZE
+#define ANNOYLIB_WRITE_CHUNK_SIZE (1 << 24)
+#endif
+
+// With a build policy that can run tasks in parallel, subtrees with at least this many items are built
+// as separate tasks, and splits of at least this many items compute the sides of their items in parallel.
+#ifndef ANNOYLIB_PARALLEL_SUBTREE_SIZE
+#define ANNOYLIB_PARALLEL_SUBTREE_SIZE 4096
+#endif
+#ifndef ANNOYLIB_OUT_OF_CORE_SAMPLE_SIZE
+#define ANNOYLIB_OUT_OF_CORE_SAMPLE_SIZE 10000
+#endif
+#ifndef ANNOYLIB_PROJECTION_SAMPLE_SIZE
+#define ANNOYLIB_PROJECTION_SAMPLE_SIZE 10000
+#endif
+#ifndef ANNOYLIB_PROJECTION_ITERATIONS
+#define ANNOYLIB_PROJECTION_ITERATIONS 30
+#endif
+#ifndef ANNOYLIB_PARALLEL_SPLIT_SIZE
+#define ANNOYLIB_PARALLEL_SPLIT_SIZE 65536
+#endif
+#ifndef ANNOYLIB_PARALLEL_SPLIT_GRAIN
+#define ANNOYLIB_PARALLEL_SPLIT_GRAIN 16384
+#endif
+
+// While building, every thread writes the nodes it creates to its own blocks of about this many bytes,
+// which are copied into the index once all trees are done.
+#ifndef ANNOYLIB_NODE_BLOCK_SIZE
+#define ANNOYLIB_NODE_BLOCK_SIZE (1 << 20)
+#endif
+
 #ifndef _MSC_VER
 #define annoylib_popcount __builtin_popcountll
 #else // See #293, #358
@@ -162,6 +201,202 @@ inline bool remap_memory_and_truncate(void** _ptr, int _fd, size_t old_size, siz
     return ok;
 }
 
+inline void prefault_pages(const void* data, size_t size) {
+  // Reads one byte per page so that the pages of an mmapped index get faulted in
+  const size_t page_size = 4096;
+#if defined(MADV_WILLNEED) && !defined(_MSC_VER) && !defined(__MINGW32__)
+  size_t offset = (size_t)data % page_size;
+  madvise((char*)data - offset, size + offset, MADV_WILLNEED);
+#endif
+  const volatile char* p = (const volatile char*)data;
+  for (size_t i = 0; i < size; i += page_size)
+    (void)p[i];
+  if (size > 0)
+    (void)p[size - 1];
+}
+
+class AnnoyVectorFile {
+  /*
+   * A file of float32 vectors with f dimensions each, mmapped for reading. The supported formats are:
+   * - "npy": a 2-d little-endian float32 array in C order, as written by numpy.save
+   * - "fvecs": every vector is preceded by its number of dimensions, as an int32
+   * - "raw": just the vectors, one after the other
+   * "auto" (or NULL) picks the format from the file extension, and falls back to raw.
+   */
+public:
+  AnnoyVectorFile() : _data(NULL), _size(0), _rows(NULL), _n_rows(0), _stride(0) {}
+  ~AnnoyVectorFile() {
+    close();
+  }
+
+  bool open(const char* filename, const char* format=NULL, int f=0, char** error=NULL) {
+    close();
+    if (!format || !strcmp(format, "auto")) {
+      const char* extension = strrchr(filename, '.');
+      format = extension && (!strcmp(extension, ".npy") || !strcmp(extension, ".fvecs")) ? extension + 1 : "raw";
+    }
+    if (strcmp(format, "npy") && strcmp(format, "fvecs") && strcmp(format, "raw")) {
+      set_error_from_string(error, "Unknown vector file format, use npy, fvecs or raw");
+      return false;
+    }
+
+#ifndef _MSC_VER
+    int fd = ::open(filename, O_RDONLY, (int)0400);
+#else
+    int fd = _open(filename, _O_RDONLY, (int)0400);
+#endif
+    if (fd == -1) {
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+    off_t size = lseek_getsize(fd);
+    if (size > 0)
+      _data = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+#ifndef _MSC_VER
+    ::close(fd);  // The mapping stays valid
+#else
+    _close(fd);
+#endif
+    if (size == -1) {
+      set_error_from_errno(error, "Unable to get size");
+      return false;
+    } else if (size == 0) {
+      set_error_from_string(error, "Vector file is empty");
+      return false;
+    } else if (_data == MAP_FAILED) {
+      _data = NULL;
+      set_error_from_errno(error, "Unable to mmap");
+      return false;
+    }
+    _size = (size_t)size;
+#if defined(MADV_SEQUENTIAL) && !defined(_MSC_VER) && !defined(__MINGW32__)
+    madvise(_data, _size, MADV_SEQUENTIAL);
+#endif
+
+    const char* data = (const char*)_data;
+    const size_t row_size = (size_t)f * sizeof(float);
+    bool ok;
+    if (!strcmp(format, "npy")) {
+      ok = _parse_npy(f, error);
+    } else if (!strcmp(format, "fvecs")) {
+      _stride = sizeof(int32_t) + row_size;
+      // Every row has to have the index's dimension, not just the first one
+      ok = _size % _stride == 0;
+      for (size_t i = 0; ok && i < _size / _stride; i++) {
+        int32_t dim;
+        memcpy(&dim, data + i * _stride, sizeof(dim));
+        ok = dim == f;
+      }
+      if (!ok)
+        set_error_from_string(error, "Vector file is not an fvecs file with vectors of the index's dimension");
+      _rows = data + sizeof(int32_t);
+      _n_rows = _size / _stride;
+    } else {
+      _stride = row_size;
+      ok = row_size > 0 && _size % row_size == 0;
+      if (!ok)
+        set_error_from_string(error, "Vector file size is not a multiple of the vector size");
+      _rows = data;
+      _n_rows = ok ? _size / _stride : 0;
+    }
+    if (!ok)
+      close();
+    return ok;
+  }
+
+  void close() {
+    if (_data)
+      munmap(_data, _size);
+    _data = NULL;
+    _size = 0;
+    _rows = NULL;
+    _n_rows = 0;
+  }
+
+  size_t get_n_rows() const {
+    return _n_rows;
+  }
+
+  size_t get_stride() const {
+    // Number of bytes from one row to the next
+    return _stride;
+  }
+
+  const float* get_row(size_t i) const {
+    return (const float*)(_rows + i * _stride);
+  }
+
+protected:
+  void* _data;
+  size_t _size;
+  const char* _rows;
+  size_t _n_rows;
+  size_t _stride;
+
+  bool _parse_npy(int f, char** error) {
+    const char* data = (const char*)_data;
+    size_t header_start, header_size;
+    if (_size >= 10 && !memcmp(data, "\x93NUMPY", 6) && data[6] == 1) {
+      header_start = 10;
+      header_size = (uint8_t)data[8] | ((size_t)(uint8_t)data[9] << 8);
+    } else if (_size >= 12 && !memcmp(data, "\x93NUMPY", 6) && (data[6] == 2 || data[6] == 3)) {
+      header_start = 12;
+      uint32_t size;
+      memcpy(&size, data + 8, sizeof(size));
+      header_size = size;
+    } else {
+      set_error_from_string(error, "Vector file is not an npy file");
+      return false;
+    }
+    if (header_start + header_size > _size) {
+      set_error_from_string(error, "Vector file has a truncated npy header");
+      return false;
+    }
+
+    // The header is a Python dict literal, like {'descr': '<f4', 'fortran_order': False, 'shape': (1000, 100), }
+    vector<char> header(data + header_start, data + header_start + header_size);
+    header.push_back(0);
+    const char* descr = _npy_value(&header[0], "'descr'");
+    const char* fortran_order = _npy_value(&header[0], "'fortran_order'");
+    const char* shape = _npy_value(&header[0], "'shape'");
+    if (!descr || strncmp(descr, "'<f4'", 5) || !fortran_order || strncmp(fortran_order, "False", 5)) {
+      set_error_from_string(error, "Vector file must contain a little-endian float32 array in C order");
+      return false;
+    }
+    // Exactly two dimensions, since e.g. (n, f, 2) would otherwise be read as the wrong n x f matrix
+    unsigned long long n_rows = 0, n_columns = 0;
+    bool two_dims = false;
+    if (shape && *shape == '(') {
+      char* end;
+      n_rows = strtoull(shape + 1, &end, 10);
+      if (*end == ',') {
+        n_columns = strtoull(end + 1, &end, 10);
+        while (*end == ' ')
+          end++;
+        two_dims = *end == ')';
+      }
+    }
+    _rows = data + header_start + header_size;
+    _stride = (size_t)f * sizeof(float);
+    if (!two_dims || n_columns != (unsigned long long)f || n_rows * _stride > _size - (header_start + header_size)) {
+      set_error_from_string(error, "Vector file must contain an array of shape (n, f) where f is the index's dimension");
+      return false;
+    }
+    _n_rows = (size_t)n_rows;
+    return true;
+  }
+
+  static const char* _npy_value(const char* header, const char* key) {
+    const char* p = strstr(header, key);
+    if (!p)
+      return NULL;
+    p += strlen(key);
+    while (*p == ' ' || *p == ':')
+      p++;
+    return p;
+  }
+};
+
 namespace {
 
 template<typename S, typename Node>
@@ -416,6 +651,12 @@ struct Base {
     // on the entire set of nodes passed into this index.
   }
 
+  template<typename T, typename S, typename Node>
+  static inline void preprocess_item(void*, size_t, const S, const S, const int) {
+    // Override this in specific metric structs below if items inserted into a built index
+    // need the pre- and post-processing that the other items got when the index was built.
+  }
+
   template<typename Node>
   static inline void zero_value(Node* dest) {
     // Initialize any fields that require sane defaults within this node.
@@ -693,6 +934,26 @@ struct DotProduct : Angular {
     }
   }
 
+  template<typename T, typename S, typename Node>
+  static inline void preprocess_item(void* nodes, size_t _s, const S node_count, const S item, const int f) {
+    // The other items keep the extra dimension they got from the maximum norm at build time, which
+    // preprocess stored in their norm. Items with a larger norm than that get no extra dimension.
+    T max_norm_squared = 0;
+    for (S i = 0; i < node_count; i++) {
+      Node* other = get_node_ptr<S, Node>(nodes, _s, i);
+      if (i != item && other->n_descendants == 1) {
+        max_norm_squared = other->norm;
+        break;
+      }
+    }
+
+    Node* node = get_node_ptr<S, Node>(nodes, _s, item);
+    T squared_norm_diff = max_norm_squared - dot(node->v, node->v, f);
+    node->dot_factor = squared_norm_diff < 0 ? 0 : sqrt(squared_norm_diff);
+    node->norm = max_norm_squared;
+    node->built = true;
+  }
+
   template<typename T, typename S, typename Node>
   static inline void postprocess(void* nodes, size_t _s, const S node_count, const int f) {
     for (S i = 0; i < node_count; i++) {
@@ -711,7 +972,8 @@ struct Hamming : Base {
     T v[ANNOYLIB_V_ARRAY_SIZE];
   };
 
-  static const size_t max_iterations = 20;
+  static const size_t split_sample_size = 256;
+  static const int split_probes = 16;
 
   template<typename T>
   static inline T pq_distance(T distance, T margin, int child_nr) {
@@ -757,38 +1019,84 @@ struct Hamming : Base {
   }
   template<typename S, typename T, typename Random>
   static inline void create_split(const vector<Node<S, T>*>& nodes, int f, size_t s, Random& random, Node<S, T>* n) {
-    size_t cur_size = 0;
-    size_t i = 0;
-    int dim = f * 8 * sizeof(T);
-    for (; i < max_iterations; i++) {
-      // choose random position to split at
-      n->v[0] = random.index(dim);
-      cur_size = 0;
-      for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
-        if (margin(n, (*it)->v, f)) {
-          cur_size++;
-        }
-      }
-      if (cur_size > 0 && cur_size < nodes.size()) {
-        break;
+    // Large splits look at a sample. A few random bits usually split dense vectors well enough, which is much cheaper
+    // than counting all their bits. Otherwise we count the bits, and only count all nodes if no bit splits the sample.
+    if (nodes.size() > split_sample_size) {
+      vector<Node<S, T>*> sample(split_sample_size);
+      for (size_t i = 0; i < split_sample_size; i++)
+        sample[i] = nodes[random.index(nodes.size())];
+      if (probe_bit(sample, f, random, n) || pick_bit(sample, f, random, n))
+        return;
+    } else if (probe_bit(nodes, f, random, n)) {
+      return;
+    }
+    if (!pick_bit(nodes, f, random, n))
+      n->v[0] = random.index(f * 8 * sizeof(T)); // All nodes are the same, so _make_tree assigns them to random sides
+  }
+  template<typename S, typename T, typename Random>
+  static inline bool probe_bit(const vector<Node<S, T>*>& nodes, int f, Random& random, Node<S, T>* n) {
+    // Takes the first of a few random bits that between a quarter and three quarters of the nodes have.
+    // Otherwise the most balanced of them will do if at least 1/16 of the nodes are on its smaller side.
+    // More lopsided splits make trees deep enough that counting all bits pays off.
+    size_t n_nodes = nodes.size();
+    size_t best = n_nodes;
+    T best_bit = 0;
+    for (int i = 0; i < split_probes; i++) {
+      n->v[0] = random.index(f * 8 * sizeof(T));
+      size_t c = 0;
+      for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it)
+        c += margin(n, (*it)->v, f);
+      size_t distance = 2 * c > n_nodes ? 2 * c - n_nodes : n_nodes - 2 * c; // Twice the distance from half
+      if (2 * distance <= n_nodes)
+        return true;
+      if (distance < best) {
+        best = distance;
+        best_bit = n->v[0];
       }
     }
-    // brute-force search for splitting coordinate
-    if (i == max_iterations) {
-      int j = 0;
-      for (; j < dim; j++) {
-        n->v[0] = j;
-        cur_size = 0;
-        for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
-          if (margin(n, (*it)->v, f)) {
-            cur_size++;
-          }
-        }
-        if (cur_size > 0 && cur_size < nodes.size()) {
-          break;
+    n->v[0] = best_bit;
+    return 8 * best <= 7 * n_nodes;
+  }
+  template<typename S, typename T, typename Random>
+  static inline bool pick_bit(const vector<Node<S, T>*>& nodes, int f, Random& random, Node<S, T>* n) {
+    // Counts how many nodes have each bit in one pass, and then splits on one of the bits that are about as close
+    // to half of the nodes as the best one. Picking at random among those keeps the trees from being all the same.
+    static const size_t n_bits = sizeof(T) * 8;
+    size_t dim = f * n_bits;
+    vector<size_t> counts(dim, 0);
+    for (typename vector<Node<S, T>*>::const_iterator it = nodes.begin(); it != nodes.end(); ++it) {
+      const T* v = (*it)->v;
+      for (int z = 0; z < f; z++) {
+        for (T w = v[z]; w; w &= w - 1) {
+          size_t bit = annoylib_popcount((w & (~w + 1)) - 1); // The lowest bit that is set
+          counts[z * n_bits + n_bits - 1 - bit]++;
         }
       }
     }
+
+    // Turns the counts into twice their distance from half of the nodes, or the number of nodes for bits that
+    // all or none of the nodes have
+    size_t n_nodes = nodes.size();
+    size_t best = n_nodes;
+    for (size_t i = 0; i < dim; i++) {
+      size_t c = counts[i];
+      counts[i] = (c == 0 || c == n_nodes) ? n_nodes : (2 * c > n_nodes ? 2 * c - n_nodes : n_nodes - 2 * c);
+      best = std::min(best, counts[i]);
+    }
+    if (best == n_nodes)
+      return false;
+
+    size_t limit = std::min(best + n_nodes / 10, n_nodes - 1), n_candidates = 0;
+    for (size_t i = 0; i < dim; i++)
+      n_candidates += counts[i] <= limit;
+    size_t k = random.index(n_candidates);
+    for (size_t i = 0; i < dim; i++) {
+      if (counts[i] <= limit && k-- == 0) {
+        n->v[0] = i;
+        break;
+      }
+    }
+    return true;
   }
   template<typename T>
   static inline T normalized_distance(T distance) {
@@ -901,25 +1209,93 @@ struct Manhattan : Minkowski {
   }
 };
 
+struct AnnoyMemoryUsage {
+  // Bytes used by each part of an index. The tree nodes are split into split nodes (holding a hyperplane)
+  // and leaf buckets (holding a list of items), and slack is allocated space that isn't used yet.
+  size_t item_vectors;
+  size_t split_nodes;
+  size_t leaf_buckets;
+  size_t root_copies;
+  size_t slack;
+  size_t total;
+};
+
+struct AnnoyTreeStats {
+  // The shape of one tree, see get_tree_stats. Items that are children of split nodes count as leaves with one item.
+  size_t n_split_nodes;
+  size_t n_leaves;
+  size_t n_random_splits;   // Split nodes where _make_tree found no hyperplane and put the items on random sides
+  vector<size_t> depths;    // depths[d] is the number of leaves at depth d, where the root has depth 0
+  vector<size_t> leaf_sizes; // leaf_sizes[k] is the number of leaves with k items
+  vector<size_t> imbalance; // Split nodes by max(left, right) / (left + right), in 10 bins from 0.5 to 1
+  double mean_imbalance;
+};
+
+struct AnnoyCandidateStats {
+  // Candidates collected from the trees by the queries of get_candidate_stats, before removing duplicates
+  size_t n_queries;
+  size_t n_candidates;
+  size_t n_unique;
+};
+
+struct AnnoyBuildProgress {
+  // Reported by builds through the build callback. The numbers are for the trees being built right now.
+  size_t n_trees;        // Trees finished so far
+  size_t n_trees_total;  // Trees to build, or 0 if the build stops once the trees are as large as the items
+  size_t n_nodes;        // Nodes allocated for the new trees so far
+  double elapsed;        // Seconds since the build started
+  double eta;            // Estimated seconds left, or -1 if there's no estimate yet
+};
+
+// Called from any of the build threads, one at a time. Returning false cancels the build.
+typedef bool (*AnnoyBuildCallback)(const AnnoyBuildProgress* progress, void* arg);
+
 template<typename S, typename T, typename R = uint64_t>
 class AnnoyIndexInterface {
  public:
   // Note that the methods with an **error argument will allocate memory and write the pointer to that string if error is non-NULL
   virtual ~AnnoyIndexInterface() {};
   virtual bool add_item(S item, const T* w, char** error=NULL) = 0;
+  virtual bool add_items(const S* items, const T* w, size_t n, int n_threads=-1, char** error=NULL) = 0;
+  virtual bool add_items_from_file(const char* filename, const char* format=NULL, int n_threads=-1, char** error=NULL) = 0;
   virtual bool build(int q, int n_threads=-1, char** error=NULL) = 0;
+  virtual bool build_with_memory_budget(size_t memory_budget, int n_threads=-1, char** error=NULL) = 0;
+  virtual bool add_trees(int q, int n_threads=-1, char** error=NULL) = 0;
+  virtual bool insert_item(S item, const T* w, char** error=NULL) = 0;
+  virtual bool mark_deleted(S item, char** error=NULL) = 0;
+  virtual bool compact(char** error=NULL) = 0;
+  virtual bool merge(const AnnoyIndexInterface<S, T, R>* other, char** error=NULL) = 0;
+  virtual bool merge_trees(const AnnoyIndexInterface<S, T, R>* other, char** error=NULL) = 0;
   virtual bool unbuild(char** error=NULL) = 0;
   virtual bool save(const char* filename, bool prefault=false, char** error=NULL) = 0;
+  virtual bool save(const char* filename, bool prefault, bool reload, bool atomic, char** error=NULL) = 0;
+  virtual bool save_to_fd(int fd, char** error=NULL) = 0;
   virtual void unload() = 0;
   virtual bool load(const char* filename, bool prefault=false, char** error=NULL) = 0;
+  virtual void prefault_async(int n_threads=-1) = 0;
+  virtual double get_prefault_progress() const = 0;
+  virtual void wait_prefault() = 0;
   virtual T get_distance(S i, S j) const = 0;
   virtual void get_nns_by_item(S item, size_t n, int search_k, vector<S>* result, vector<T>* distances) const = 0;
   virtual void get_nns_by_vector(const T* w, size_t n, int search_k, vector<S>* result, vector<T>* distances) const = 0;
+  virtual void get_nns_by_vectors(const T* w, size_t n_queries, size_t n, int search_k, S* result, T* distances, int n_threads=-1) const = 0;
   virtual S get_n_items() const = 0;
   virtual S get_n_trees() const = 0;
+  virtual void get_memory_usage(AnnoyMemoryUsage* usage) const = 0;
+  virtual bool get_tree_stats(S tree, AnnoyTreeStats* stats, char** error=NULL) const = 0;
+  virtual void get_candidate_stats(size_t n_queries, size_t n, int search_k, AnnoyCandidateStats* stats) const = 0;
   virtual void verbose(bool v) = 0;
   virtual void get_item(S item, T* v) const = 0;
+  virtual const T* get_item_vectors(size_t* stride) const = 0;
   virtual void set_seed(R q) = 0;
+  virtual bool set_split_sample_size(size_t n, char** error=NULL) = 0;
+  virtual void set_out_of_core_memory(size_t memory) = 0;
+  virtual bool set_projection(int n_components, char** error=NULL) = 0;
+  virtual int get_projection(T* components) const = 0;
+  virtual S get_max_leaf_size() const = 0;
+  virtual void set_deterministic_build(bool deterministic) = 0;
+  virtual void set_build_callback(AnnoyBuildCallback callback, void* arg=NULL) = 0;
+  virtual void cancel_build() = 0;
   virtual bool on_disk_build(const char* filename, char** error=NULL) = 0;
 };
 
@@ -951,24 +1327,68 @@ protected:
   const int _f;
   size_t _s;
   S _n_items;
+  S _n_item_slots; // The nodes of the trees come after this many items, so ids below it are items
   void* _nodes; // Could either be mmapped, or point to a memory buffer that we reallocate
   S _n_nodes;
   S _nodes_size;
   vector<S> _roots;
-  S _K;
+  S _K; // The most items a leaf can have, while nodes with more descendants are split nodes
+  S _leaf_capacity; // The most items that fit into a node, larger leaves keep their items in _buckets
+  S _max_leaf_size; // _K for indexes we build, which loaded indexes replace by the leaf size of the file
+  vector<S> _buckets; // The items of large leaves, see _set_leaf
+  const S* _loaded_buckets; // The buckets of a loaded index, in the file after the nodes
+  size_t _n_loaded_buckets;
+  S _n_footer_nodes; // The projection, buckets and footer after the nodes, see _append_root_copies
+  int _n_components; // The components of the projection that builds learn, see set_projection
+  int _projected_f; // The number of components of the projection of the trees, or 0 if they use the item vectors
+  size_t _ps; // The size of a projected item
+  vector<T> _projection; // _projected_f rows with the components
+  vector<char> _projected_items; // The projected items that the splits are made on, while we need them
   R _seed;
+  size_t _split_sample_size;
+  size_t _out_of_core_memory;
   bool _loaded;
   bool _verbose;
   int _fd;
   bool _on_disk;
   bool _built;
+  typename ThreadedBuildPolicy::Prefaulter _prefaulter;
+  AnnoyBuildCallback _build_callback;
+  void* _build_callback_arg;
+  typename ThreadedBuildPolicy::StopFlag _cancelled; // Set by cancel_build, until a build stops because of it
+  typename ThreadedBuildPolicy::StopFlag _building;
+
+  struct _NodeBlock {
+    size_t index; // Blocks are numbered in the order they were reserved
+    S n_nodes;
+    char* nodes;
+    char* mapping; // With on_disk_build, the mmapped part of the file that holds the block, otherwise NULL
+    size_t mapping_size;
+  };
+  vector<vector<_NodeBlock> > _arenas; // The blocks of nodes that each thread created in the current build
+  R _build_seed; // The seed of the trees in the current build, which thread_build varies per thread
+  AnnoyBuildProgress _progress; // Of the current build, only changed while holding lock_progress
+  int _build_q; // The number of trees of the current build, or -1
+  double _progress_start;
+  double _progress_reported;
+  size_t _run_memory; // The memory for the items of a subtree in the current build, see set_out_of_core_memory
+  bool _deterministic;
+  size_t _n_trees_taken; // By thread_build in a deterministic build, which numbers the trees in the order they're taken
+  vector<pair<size_t, S> > _tree_roots; // The numbers and roots of the trees of a deterministic build
 public:
 
-   AnnoyIndex(int f) : _f(f), _seed(Random::default_seed) {
+   AnnoyIndex(int f, S max_leaf_size=0) : _f(f), _seed(Random::default_seed), _split_sample_size(0), _out_of_core_memory(0), _deterministic(false) {
     _s = offsetof(Node, v) + _f * sizeof(T); // Size of each node
     _verbose = false;
     _built = false;
-    _K = (S) (((size_t) (_s - offsetof(Node, children))) / sizeof(S)); // Max number of descendants to fit into node
+    _build_callback = NULL;
+    _build_callback_arg = NULL;
+    _cancelled = false;
+    _building = false;
+    _n_components = 0;
+    _leaf_capacity = (S) (((size_t) (_s - offsetof(Node, children))) / sizeof(S)); // Max number of descendants to fit into node
+    // 0 picks as many items as fit into a node. Leaves need at least 2 items, or splits would never end.
+    _max_leaf_size = max_leaf_size == 0 ? _leaf_capacity : std::max((S)2, max_leaf_size);
     reinitialize(); // Reset everything
   }
   ~AnnoyIndex() {
@@ -990,26 +1410,95 @@ public:
       return false;
     }
     _allocate_size(item + 1);
-    Node* n = _get(item);
+    _set_item(item, w);
 
-    D::zero_value(n);
+    if (item >= _n_items)
+      _n_items = item + 1;
 
-    n->children[0] = 0;
-    n->children[1] = 0;
-    n->n_descendants = 1;
+    return true;
+  }
 
-    for (int z = 0; z < _f; z++)
-      n->v[z] = w[z];
+  bool add_items(const S* items, const T* w, size_t n, int n_threads=-1, char** error=NULL) {
+    // Adds n items whose vectors are the rows of the n x f matrix w. The nodes are allocated once,
+    // and the rows are copied by n_threads threads (if the build policy supports threads).
+    // Without items, the rows are added as the items following the existing ones.
+    if (_loaded) {
+      set_error_from_string(error, "You can't add an item to a loaded index");
+      return false;
+    }
+    if (n == 0)
+      return true;
+    if (!items) {
+      if (n > (size_t)(numeric_limits<S>::max() - _n_items)) {
+        set_error_from_string(error, "Too many items");
+        return false;
+      }
+      _allocate_size(_n_items + (S)n);
+      _AddItemsTask<T> task = {this, NULL, _n_items, (const char*)w, _f * sizeof(T)};
+      ThreadedBuildPolicy::parallel_ranges(n, ANNOYLIB_PARALLEL_SPLIT_GRAIN, n_threads, task);
+      _n_items += (S)n;
+      return true;
+    }
 
-    D::init_node(n, _f);
+    S max_item = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (items[i] < 0) {
+        set_error_from_string(error, "Item index can not be negative");
+        return false;
+      }
+      max_item = std::max(max_item, items[i]);
+    }
+    // Threads would race on the node of an item that is added twice
+    vector<bool> seen((size_t)max_item + 1, false);
+    for (size_t i = 0; i < n; i++) {
+      if (seen[items[i]]) {
+        set_error_from_string(error, "Items can only be added once per call to add_items");
+        return false;
+      }
+      seen[items[i]] = true;
+    }
 
-    if (item >= _n_items)
-      _n_items = item + 1;
+    _allocate_size(max_item + 1);
+    _AddItemsTask<T> task = {this, items, 0, (const char*)w, _f * sizeof(T)};
+    ThreadedBuildPolicy::parallel_ranges(n, ANNOYLIB_PARALLEL_SPLIT_GRAIN, n_threads, task);
+
+    if (max_item >= _n_items)
+      _n_items = max_item + 1;
+
+    return true;
+  }
+
+  bool add_items_from_file(const char* filename, const char* format=NULL, int n_threads=-1, char** error=NULL) {
+    // Adds the float32 vectors in an npy, fvecs or raw file (see AnnoyVectorFile) as the items following
+    // the existing ones. The file is mmapped, so with on_disk_build this works for files larger than memory.
+    if (_loaded) {
+      set_error_from_string(error, "You can't add an item to a loaded index");
+      return false;
+    }
+    AnnoyVectorFile file;
+    if (!file.open(filename, format, _f, error))
+      return false;
+    size_t n = file.get_n_rows();
+    if (n > (size_t)(numeric_limits<S>::max() - _n_items)) {
+      set_error_from_string(error, "Vector file has too many vectors");
+      return false;
+    }
+    if (n == 0)
+      return true;
+
+    _allocate_size(_n_items + (S)n);
+    _AddItemsTask<float> task = {this, NULL, _n_items, (const char*)file.get_row(0), file.get_stride()};
+    ThreadedBuildPolicy::parallel_ranges(n, ANNOYLIB_PARALLEL_SPLIT_GRAIN, n_threads, task);
+    _n_items += (S)n;
 
     return true;
   }
     
   bool on_disk_build(const char* file, char** error=NULL) {
+    // A loaded index is copied to the file, so that add_trees, merge_trees and the like change it there
+    // instead of copying it to memory. Its trees are then saved in the file like those of a build.
+    if (_loaded)
+      return _copy_to_memory(error, file);
     _on_disk = true;
 #ifndef _MSC_VER
     _fd = open(file, O_RDWR | O_CREAT | O_TRUNC, (int) 0600);
@@ -1035,110 +1524,514 @@ public:
   }
     
   bool build(int q, int n_threads=-1, char** error=NULL) {
-    if (_loaded) {
-      set_error_from_string(error, "You can't build a loaded index");
+    if (!_prepare_build(error))
       return false;
-    }
 
-    if (_built) {
-      set_error_from_string(error, "You can't build a built index");
+    if (!_build_trees(q, n_threads)) {
+      _n_nodes = _n_items;
+      set_error_from_string(error, "The build was cancelled");
       return false;
     }
 
-    D::template preprocess<T, S, Node>(_nodes, _s, _n_items, _f);
-
-    _n_nodes = _n_items;
+    return _finish_build(error);
+  }
 
-    ThreadedBuildPolicy::template build<S, T>(this, q, n_threads);
+  bool build_with_memory_budget(size_t memory_budget, int n_threads=-1, char** error=NULL) {
+    // Builds as many trees as fit in memory_budget bytes, which is the size of the index once saved.
+    // We build one tree to see how large trees get, then fill up most of the remaining budget in bulk.
+    // The last few trees are built one at a time, so that a tree that doesn't fit can be dropped.
+    const double tree_size_margin = 1.1;
+    const size_t max_nodes = memory_budget / _s;
 
-    // Also, copy the roots into the last segment of the array
-    // This way we can load them faster without reading the whole file
-    _allocate_size(_n_nodes + (S)_roots.size());
-    for (size_t i = 0; i < _roots.size(); i++)
-      memcpy(_get(_n_nodes + (S)i), _get(_roots[i]), _s);
-    _n_nodes += _roots.size();
+    if (!_prepare_build(error))
+      return false;
 
-    if (_verbose) annoylib_showUpdate("has %d nodes\n", _n_nodes);
-    
-    if (_on_disk) {
-      if (!remap_memory_and_truncate(&_nodes, _fd,
-          static_cast<size_t>(_s) * static_cast<size_t>(_nodes_size),
-          static_cast<size_t>(_s) * static_cast<size_t>(_n_nodes))) {
-        // TODO: this probably creates an index in a corrupt state... not sure what to do
-        set_error_from_errno(error, "Unable to truncate");
+    double tree_size = 0;
+    int q = 1;
+    while (q > 0) {
+      S n_nodes_before = _n_nodes;
+      size_t n_buckets_before = _buckets.size();
+      if (!_build_trees(q, n_threads)) {
+        _roots.clear();
+        _buckets.clear();
+        _n_nodes = _n_items;
+        set_error_from_string(error, "The build was cancelled");
         return false;
       }
-      _nodes_size = _n_nodes;
+      // Every tree also needs a copy of its root at the end of the index, and its buckets go into the footer
+      double bucket_nodes = (double)(_buckets.size() - n_buckets_before) * sizeof(S) / _s;
+      tree_size = std::max(tree_size, ((double)(_n_nodes - n_nodes_before) + bucket_nodes) / q + 1);
+      size_t used = (size_t)_n_nodes + _roots.size() + _n_footer_nodes_for(_buckets.size());
+
+      if (used > max_nodes) {
+        // Only happens for single trees, whose nodes and buckets are all at the end of their arrays
+        _n_nodes = n_nodes_before;
+        _roots.pop_back();
+        _buckets.resize(n_buckets_before);
+        break;
+      }
+
+      double trees_left = (max_nodes - used) / tree_size;
+      if (trees_left / tree_size_margin > 3)
+        q = (int)std::min(trees_left / tree_size_margin - 2, (double)numeric_limits<int>::max());
+      else
+        q = trees_left >= 1 ? 1 : 0;
+      if (_verbose) annoylib_showUpdate("built %zu trees within the memory budget, building %d more\n", _roots.size(), q);
     }
 
-    D::template postprocess<T, S, Node>(_nodes, _s, _n_items, _f);
+    if (_roots.empty()) {
+      _n_nodes = _n_items;
+      _buckets.clear();
+      set_error_from_string(error, "The memory budget is too small to fit a single tree");
+      return false;
+    }
 
-    _built = true;
-    return true;
+    return _finish_build(error);
   }
-  
-  bool unbuild(char** error=NULL) {
-    if (_loaded) {
-      set_error_from_string(error, "You can't unbuild a loaded index");
+
+  bool add_trees(int q, int n_threads=-1, char** error=NULL) {
+    // Builds q more trees for a built or loaded index. A loaded index is copied to memory first,
+    // so it needs to be saved again afterwards.
+    if (!_built) {
+      set_error_from_string(error, "You can only add trees to a built or loaded index");
+      return false;
+    }
+    if (q < 1) {
+      set_error_from_string(error, "The number of trees to add must be positive");
       return false;
     }
 
-    _roots.clear();
-    _n_nodes = _n_items;
+    // The copies of the roots at the end will be overwritten by the new trees
+    if (_loaded && !_copy_to_memory(error))
+      return false;
+
+    _n_nodes -= (S)_roots.size();
     _built = false;
+    D::template preprocess<T, S, Node>(_nodes, _s, _n_items, _f);
+    _ensure_projected_items();
+    if (!_build_trees(q, n_threads)) {
+      // We still have the trees from before
+      _finish_build(NULL);
+      set_error_from_string(error, "The build was cancelled");
+      return false;
+    }
+    return _finish_build(error);
+  }
+
+  bool insert_item(S item, const T* w, char** error=NULL) {
+    return insert_item_impl(item, w, error);
+  }
+
+  template<typename W>
+  bool insert_item_impl(S item, const W& w, char** error=NULL) {
+    // Adds an item to a built index by putting it into the leaf it falls into in each tree, and splitting
+    // leaves that get too large. A loaded index is copied to memory first, so it needs to be saved again.
+    if (!_built)
+      return add_item_impl(item, w, error);
+    if (item < _n_items && _get(item)->n_descendants == 1) {
+      set_error_from_string(error, "You can't insert an item that is already in the index");
+      return false;
+    }
+    if (_loaded && !_copy_to_memory(error))
+      return false;
+
+    // The copies of the roots move behind the nodes we add
+    _n_nodes -= (S)_roots.size();
+    if (item < _n_items && _get(item)->children[0] == 1) {
+      // A deleted item that is still in the trees, which we take out of them with its old vector first
+      Random remove_random(_seed + (R)item);
+      for (size_t i = 0; i < _roots.size(); i++) {
+        S replacement;
+        _remove_from_tree(_roots[i], item, true, remove_random, &replacement);
+      }
+    }
+    if (item >= _n_item_slots)
+      _add_item_slots(item + 1);
+    _set_item(item, w);
+    if (item >= _n_items)
+      _n_items = item + 1;
+    D::template preprocess_item<T, S, Node>(_nodes, _s, _n_items, item, _f);
+    if (_projected_f) {
+      _ensure_projected_items();
+      _project_item(item, &_projected_items[0]);
+      D::template preprocess_item<T, S, Node>(&_projected_items[0], _ps, _n_items, item, _projected_f);
+    }
+
+    Random random(_seed + (R)item);
+    for (size_t i = 0; i < _roots.size(); i++)
+      _insert_into_tree(_roots[i], item, random);
+
+    return _append_root_copies(error);
+  }
+
+  bool mark_deleted(S item, char** error=NULL) {
+    // A deleted item keeps its vector, but has no descendants, just like ids that were never added.
+    // So queries skip it before computing its distance, and it is left out of trees built later.
+    // compact() removes it from the trees, and children[0] (unused by items) is 1 until then, so that
+    // insert_item can remove it from its old leaves if it is inserted again. A loaded index is copied to memory first.
+    if (item >= _n_items || _get(item)->n_descendants != 1) {
+      set_error_from_string(error, "You can't delete an item that isn't in the index");
+      return false;
+    }
+    if (_loaded && !_copy_to_memory(error))
+      return false;
 
+    _get(item)->n_descendants = 0;
+    _get(item)->children[0] = 1;
     return true;
   }
 
-  bool save(const char* filename, bool prefault=false, char** error=NULL) {
+  bool compact(char** error=NULL) {
+    // Removes the deleted items from the leaves. Split nodes with an empty side are dropped, and subtrees that
+    // are left with at most _K items become leaves. The remaining nodes are moved together behind the items.
     if (!_built) {
-      set_error_from_string(error, "You can't save an index that hasn't been built");
+      set_error_from_string(error, "You can only compact a built or loaded index");
       return false;
     }
-    if (_on_disk) {
-      return true;
-    } else {
-      // Delete file if it already exists (See issue #335)
-#ifndef _MSC_VER
-      unlink(filename);
-#else
-      _unlink(filename);
-#endif
+    if (_loaded && !_copy_to_memory(error))
+      return false;
+    _ensure_projected_items();
 
-      FILE *f = fopen(filename, "wb");
-      if (f == NULL) {
-        set_error_from_errno(error, "Unable to open");
-        return false;
+    vector<char> nodes;
+    vector<S> buckets;
+    vector<bool> small(_roots.size(), false);
+    vector<vector<S> > small_roots(_roots.size());
+    for (size_t i = 0; i < _roots.size(); i++) {
+      if (_get(_roots[i])->n_descendants <= _K) {
+        // A leaf that lists all items, which we make again from the items that are left
+        small[i] = true;
+        for (S j = 0; j < _n_items; j++) {
+          if (_get(j)->n_descendants == 1)
+            small_roots[i].push_back(j);
+        }
+        continue;
       }
 
-      if (fwrite(_nodes, _s, _n_nodes, f) != (size_t) _n_nodes) {
-        set_error_from_errno(error, "Unable to write");
-        return false;
+      size_t n_nodes_before = nodes.size() / _s;
+      S n_descendants;
+      S root = _compact_tree(_roots[i], &nodes, &buckets, &n_descendants);
+      if (n_descendants > _K) {
+        ((Node*)&nodes[(root - _n_item_slots) * _s])->n_descendants = _n_items;
+        _roots[i] = root;
+      } else {
+        // Roots need _n_items descendants, so we build these again from their items below
+        small[i] = true;
+        if (n_descendants == 1) {
+          small_roots[i].push_back(root);
+        } else if (n_descendants > 1) {
+          const S* dst = _leaf_items((Node*)&nodes[(root - _n_item_slots) * _s], buckets.empty() ? NULL : &buckets[0]);
+          small_roots[i].assign(dst, &dst[n_descendants]);
+        }
+        nodes.resize(n_nodes_before * _s);
       }
+    }
 
-      if (fclose(f) == EOF) {
-        set_error_from_errno(error, "Unable to close");
-        return false;
-      }
+    _n_nodes = _n_item_slots + (S)(nodes.size() / _s);
+    _allocate_size(_n_nodes);
+    if (!nodes.empty())
+      memcpy(_get(_n_item_slots), &nodes[0], nodes.size());
+    _buckets.swap(buckets);
+    _clear_deleted();
 
-      unload();
-      return load(filename, prefault, error);
+    Random random(_seed);
+    for (size_t i = 0; i < _roots.size(); i++) {
+      if (small[i]) {
+        S root = _make_subtree(small_roots[i], true, random);
+        _roots[i] = root;
+      }
     }
+    if (_verbose) annoylib_showUpdate("compacted the trees to %d nodes\n", _n_nodes - _n_item_slots);
+
+    return _append_root_copies(error);
   }
 
-  void reinitialize() {
-    _fd = 0;
-    _nodes = NULL;
-    _loaded = false;
-    _n_items = 0;
+  bool merge(const AnnoyIndexInterface<S, T, R>* other_index, char** error=NULL) {
+    // Adds the items and the trees of another built index, which must not have any of our item ids.
+    // The trees are copied as they are, so queries search both forests, much like querying both indexes
+    // and combining the results. A loaded index is copied to memory first, like in add_trees.
+    const AnnoyIndex* other = dynamic_cast<const AnnoyIndex*>(other_index);
+    if (!other || other->_f != _f) {
+      set_error_from_string(error, "You can only merge indexes with the same metric and number of dimensions");
+      return false;
+    }
+    if (other->_K != _K) {
+      set_error_from_string(error, "You can only merge indexes with the same leaf size");
+      return false;
+    }
+    if (other->_projected_f != _projected_f || other->_projection != _projection) {
+      set_error_from_string(error, "You can only merge indexes with the same projection");
+      return false;
+    }
+    if (other == this) {
+      set_error_from_string(error, "You can't merge an index with itself");
+      return false;
+    }
+    if (!_built || !other->_built) {
+      set_error_from_string(error, "You can only merge built or loaded indexes");
+      return false;
+    }
+    for (S j = 0; j < std::min(_n_items, other->_n_items); j++) {
+      if (_get(j)->n_descendants == 1 && other->_get(j)->n_descendants == 1) {
+        set_error_from_string(error, "You can't merge indexes that have items with the same ids");
+        return false;
+      }
+    }
+    vector<S> other_roots;
+    if (!other->_find_roots(&other_roots, error))
+      return false;
+    if (_loaded && !_copy_to_memory(error))
+      return false;
+
+    // Roots that are leaves list all items, so we make them again once we have all the items
+    vector<vector<S> > leaf_roots(2);
+    const AnnoyIndex* indexes[2] = {this, other};
+    for (int k = 0; k < 2; k++) {
+      if (!indexes[k]->_roots.empty() && indexes[k]->_get(indexes[k]->_roots[0])->n_descendants <= _K) {
+        for (S j = 0; j < indexes[k]->_n_items; j++) {
+          if (indexes[k]->_get(j)->n_descendants == 1)
+            leaf_roots[k].push_back(j);
+        }
+      }
+    }
+
+    _n_nodes -= (S)_roots.size();
+    if (other->_n_items > _n_item_slots)
+      _add_item_slots(other->_n_items);
+    for (S j = 0; j < other->_n_items; j++) {
+      if (other->_get(j)->n_descendants == 1)
+        memcpy(_get(j), other->_get(j), _s);
+    }
+    _n_items = std::max(_n_items, other->_n_items);
+    vector<char>().swap(_projected_items);
+    _ensure_projected_items();
+
+    // The nodes of the other trees go after ours
+    S offset = _append_trees(other);
+
+    size_t n_roots = _roots.size();
+    for (size_t i = 0; i < other_roots.size(); i++)
+      _roots.push_back(other_roots[i] + offset);
+
+    Random random(_seed + (R)_roots.size());
+    for (size_t i = 0; i < _roots.size(); i++) {
+      vector<S>& items = leaf_roots[i < n_roots ? 0 : 1];
+      if (items.empty() && _get(_roots[i])->n_descendants > _K) {
+        _get(_roots[i])->n_descendants = _n_items;
+      } else {
+        S root = _make_subtree(items, true, random);
+        _roots[i] = root;
+      }
+    }
+    if (_verbose) annoylib_showUpdate("merged %zu trees into %zu trees\n", _roots.size() - n_roots, _roots.size());
+
+    return _append_root_copies(error);
+  }
+
+  bool merge_trees(const AnnoyIndexInterface<S, T, R>* other_index, char** error=NULL) {
+    // Adds the trees of another built index with the same items, for instance one that was built with
+    // another seed in another process. Unlike merge, the items stay as they are and only the nodes of
+    // the trees are copied. A loaded index is copied to memory first, like in add_trees.
+    const AnnoyIndex* other = dynamic_cast<const AnnoyIndex*>(other_index);
+    if (!other || other->_f != _f) {
+      set_error_from_string(error, "You can only merge indexes with the same metric and number of dimensions");
+      return false;
+    }
+    if (other->_K != _K) {
+      set_error_from_string(error, "You can only merge indexes with the same leaf size");
+      return false;
+    }
+    if (other->_projected_f != _projected_f || other->_projection != _projection) {
+      set_error_from_string(error, "You can only merge indexes with the same projection");
+      return false;
+    }
+    if (other == this) {
+      set_error_from_string(error, "You can't merge an index with itself");
+      return false;
+    }
+    if (!_built || !other->_built) {
+      set_error_from_string(error, "You can only merge built or loaded indexes");
+      return false;
+    }
+    bool same_items = other->_n_items == _n_items;
+    for (S j = 0; same_items && j < _n_items; j++) {
+      const Node* node = _get(j);
+      const Node* other_node = other->_get(j);
+      same_items = node->n_descendants == other_node->n_descendants && (node->n_descendants != 1 || !memcmp(node, other_node, _s));
+    }
+    if (!same_items) {
+      set_error_from_string(error, "You can only merge the trees of indexes with the same items");
+      return false;
+    }
+    vector<S> other_roots;
+    if (!other->_find_roots(&other_roots, error))
+      return false;
+    if (_loaded && !_copy_to_memory(error))
+      return false;
+
+    // The nodes of the other trees go after ours, and their item ids stay valid since the items are the same
+    _n_nodes -= (S)_roots.size();
+    S offset = _append_trees(other);
+
+    for (size_t i = 0; i < other_roots.size(); i++)
+      _roots.push_back(other_roots[i] + offset);
+    if (_verbose) annoylib_showUpdate("merged %zu trees into %zu trees\n", other_roots.size(), _roots.size());
+
+    return _append_root_copies(error);
+  }
+
+  bool unbuild(char** error=NULL) {
+    if (_loaded) {
+      set_error_from_string(error, "You can't unbuild a loaded index");
+      return false;
+    }
+
+    _roots.clear();
+    _buckets.clear();
+    _clear_deleted();
+    _n_nodes = _n_items;
+    _n_item_slots = _n_items;
+    _n_footer_nodes = 0;
+    _set_projected_f(0);
+    _built = false;
+
+    return true;
+  }
+
+  bool save(const char* filename, bool prefault=false, char** error=NULL) {
+    return save(filename, prefault, true, false, error);
+  }
+
+  bool save(const char* filename, bool prefault, bool reload, bool atomic, char** error=NULL) {
+    // If reload is false, the index stays in memory as it is instead of being replaced by an mmap of the file.
+    // If atomic is true, we write to a temporary file next to the target and rename it into place.
+    if (!_built) {
+      set_error_from_string(error, "You can't save an index that hasn't been built");
+      return false;
+    }
+    if (_on_disk) {
+      return true;
+    }
+
+    vector<char> tmp_filename;
+    const char* path = filename;
+    int fd;
+    if (atomic) {
+      // Other threads or processes may be saving to the same path, so we take the first temporary
+      // file name that nobody else has created yet
+#ifndef _MSC_VER
+      int pid = (int)getpid();
+#else
+      int pid = (int)GetCurrentProcessId();
+#endif
+      tmp_filename.resize(strlen(filename) + 48);
+      path = &tmp_filename[0];
+      unsigned attempt = 0;
+      do {
+        snprintf(&tmp_filename[0], tmp_filename.size(), "%s.tmp%d.%u", filename, pid, attempt++);
+#ifndef _MSC_VER
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, (int) 0666);
+#else
+        fd = _open(path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+#endif
+      } while (fd == -1 && errno == EEXIST);
+    } else {
+      // Delete file if it already exists (See issue #335)
+#ifndef _MSC_VER
+      unlink(path);
+      fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, (int) 0666);
+#else
+      _unlink(path);
+      fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#endif
+    }
+    if (fd == -1) {
+      set_error_from_errno(error, "Unable to open");
+      return false;
+    }
+
+    bool ok = save_to_fd(fd, error);
+#ifndef _MSC_VER
+    if (close(fd) == -1 && ok) {
+#else
+    if (_close(fd) == -1 && ok) {
+#endif
+      set_error_from_errno(error, "Unable to close");
+      ok = false;
+    }
+
+    if (ok && atomic) {
+#if defined(_MSC_VER) || defined(__MINGW32__)
+      if (!MoveFileExA(path, filename, MOVEFILE_REPLACE_EXISTING)) {
+#else
+      if (rename(path, filename) == -1) {
+#endif
+        set_error_from_errno(error, "Unable to rename");
+        ok = false;
+      }
+    }
+    if (!ok) {
+#ifndef _MSC_VER
+      unlink(path);
+#else
+      _unlink(path);
+#endif
+      return false;
+    }
+
+    if (!reload)
+      return true;
+    unload();
+    return load(filename, prefault, error);
+  }
+
+  bool save_to_fd(int fd, char** error=NULL) {
+    // Writes the index through any file descriptor (files, pipes, sockets) without touching the index itself.
+    if (!_built) {
+      set_error_from_string(error, "You can't save an index that hasn't been built");
+      return false;
+    }
+    const char* data = (const char*)_nodes;
+    size_t remaining = _s * (size_t)(_n_nodes + _n_footer_nodes);
+    while (remaining > 0) {
+      size_t chunk = std::min(remaining, (size_t)ANNOYLIB_WRITE_CHUNK_SIZE);
+#ifndef _MSC_VER
+      ssize_t written = write(fd, data, chunk);
+#else
+      int written = _write(fd, data, (unsigned int)chunk);
+#endif
+      if (written == -1) {
+        if (errno == EINTR)
+          continue;
+        set_error_from_errno(error, "Unable to write");
+        return false;
+      }
+      data += written;
+      remaining -= written;
+    }
+    return true;
+  }
+
+  void reinitialize() {
+    _fd = 0;
+    _nodes = NULL;
+    _loaded = false;
+    _n_items = 0;
+    _n_item_slots = 0;
     _n_nodes = 0;
     _nodes_size = 0;
     _on_disk = false;
     _seed = Random::default_seed;
     _roots.clear();
+    _K = _max_leaf_size;
+    _buckets.clear();
+    _loaded_buckets = NULL;
+    _n_loaded_buckets = 0;
+    _n_footer_nodes = 0;
+    _set_projected_f(0);
   }
 
   void unload() {
+    _prefaulter.stop();
     if (_on_disk && _fd) {
 #ifndef _MSC_VER
       close(_fd);
@@ -1154,7 +2047,7 @@ public:
 #else
         _close(_fd);
 #endif
-        munmap(_nodes, _n_nodes * _s);
+        munmap(_nodes, (_n_nodes + _n_footer_nodes) * _s);
       } else if (_nodes) {
         // We have heap allocated data
         free(_nodes);
@@ -1198,6 +2091,10 @@ public:
     }
     _nodes = (Node*)mmap(0, size, PROT_READ, flags, _fd, 0);
     _n_nodes = (S)(size / _s);
+    if (!_read_footer(error)) {
+      unload();
+      return false;
+    }
 
     // Find the roots by scanning the end of the file and taking the nodes with most descendants
     _roots.clear();
@@ -1217,85 +2114,1311 @@ public:
     _loaded = true;
     _built = true;
     _n_items = m;
+    _n_item_slots = m;
     if (_verbose) annoylib_showUpdate("found %zu roots with degree %d\n", _roots.size(), m);
     return true;
   }
 
-  T get_distance(S i, S j) const {
-    return D::normalized_distance(D::distance(_get(i), _get(j), _f));
+  void prefault_async(int n_threads=-1) {
+    // Faults in the pages of an mmapped index using n_threads background threads, while queries keep running.
+    // The tree nodes at the end of the file are read first since every query touches them, then the item vectors.
+    _prefaulter.stop();
+    if (!_fd || !_nodes)
+      return;
+    vector<pair<const void*, size_t> > ranges;
+    ranges.push_back(make_pair((const void*)_get(_n_items), _s * (size_t)(_n_nodes + _n_footer_nodes - _n_items)));
+    ranges.push_back(make_pair((const void*)_nodes, _s * (size_t)_n_items));
+    _prefaulter.start(ranges, n_threads);
+    if (_verbose) annoylib_showUpdate("prefaulting %zu bytes\n", _s * (size_t)_n_nodes);
+  }
+
+  double get_prefault_progress() const {
+    return _prefaulter.progress();
+  }
+
+  void wait_prefault() {
+    _prefaulter.wait();
+  }
+
+  T get_distance(S i, S j) const {
+    return D::normalized_distance(D::distance(_get(i), _get(j), _f));
+  }
+
+  void get_nns_by_item(S item, size_t n, int search_k, vector<S>* result, vector<T>* distances) const {
+    // TODO: handle OOB
+    const Node* m = _get(item);
+    _get_all_nns(m->v, n, search_k, result, distances);
+  }
+
+  void get_nns_by_vector(const T* w, size_t n, int search_k, vector<S>* result, vector<T>* distances) const {
+    _get_all_nns(w, n, search_k, result, distances);
+  }
+
+  void get_nns_by_vectors(const T* w, size_t n_queries, size_t n, int search_k, S* result, T* distances, int n_threads=-1) const {
+    // Runs the queries for the n_queries vectors that follow each other in w, using n_threads threads. Row q of
+    // result and distances (which can be NULL) gets the n results of query q, padded with -1 and NaN if there
+    // are fewer.
+    _QueriesTask task = {this, w, n, search_k, result, distances};
+    ThreadedBuildPolicy::parallel_ranges(n_queries, 1, n_threads, task);
+  }
+
+  S get_n_items() const {
+    return _n_items;
+  }
+
+  S get_n_trees() const {
+    return (S)_roots.size();
+  }
+
+  void get_memory_usage(AnnoyMemoryUsage* usage) const {
+    S n_root_copies = _built ? (S)_roots.size() : 0;
+    usage->item_vectors = _s * (size_t)_n_items;
+    usage->split_nodes = 0;
+    usage->leaf_buckets = 0;
+    // Slots for more items, which insert_item leaves before the trees, count as slack
+    S n_item_slots = std::max(_n_items, _n_item_slots);
+    for (S i = n_item_slots; i < _n_nodes - n_root_copies; i++) {
+      // Same rule as in _get_all_nns: anything with more than _K descendants is a split node
+      if (_get(i)->n_descendants <= _K)
+        usage->leaf_buckets += _s;
+      else
+        usage->split_nodes += _s;
+    }
+    usage->leaf_buckets += sizeof(S) * _n_bucket_ids();
+    usage->root_copies = _s * (size_t)n_root_copies;
+    S n_nodes = _n_nodes + _n_footer_nodes;
+    usage->slack = _nodes_size > n_nodes ? _s * (size_t)(_nodes_size - n_nodes) : 0;
+    usage->slack += _s * (size_t)(n_item_slots - _n_items);
+    usage->total = usage->item_vectors + usage->split_nodes + usage->leaf_buckets + usage->root_copies + usage->slack;
+  }
+
+  bool get_tree_stats(S tree, AnnoyTreeStats* stats, char** error=NULL) const {
+    // Degenerate data, like many identical vectors, gives deep trees with lopsided or random splits, and slow queries.
+    // A split is random if some item below it isn't on its side of the hyperplane, which only happens when _make_tree
+    // fell back to random sides (or for items exactly on the hyperplane).
+    if (tree < 0 || tree >= (S)_roots.size()) {
+      set_error_from_string(error, "No such tree");
+      return false;
+    }
+    stats->n_split_nodes = stats->n_leaves = stats->n_random_splits = 0;
+    stats->depths.clear();
+    stats->leaf_sizes.clear();
+    stats->imbalance.assign(10, 0);
+    stats->mean_imbalance = 0;
+
+    // The splits were made on the projected items, which we only keep while we need them
+    const vector<char>* projected = &_projected_items;
+    vector<char> projected_copy;
+    if (_projected_f && _projected_items.size() != (size_t)_n_item_slots * _ps) {
+      _project_items(&projected_copy);
+      projected = &projected_copy;
+    }
+
+    Random random(_seed);
+    vector<char> random_split(_n_nodes - _n_item_slots, 0);
+    vector<pair<S, size_t> > stack(1, make_pair(_roots[tree], (size_t)0));
+    vector<S> path; // The split nodes above the current node
+    while (!stack.empty()) {
+      S i = stack.back().first;
+      size_t depth = stack.back().second;
+      stack.pop_back();
+      path.resize(depth);
+      Node* node = _get(i);
+
+      if (i >= _n_item_slots && node->n_descendants > _K) {
+        S sizes[2];
+        for (int side = 0; side < 2; side++) {
+          S child = node->children[side];
+          sizes[side] = child < _n_item_slots ? 1 : _get(child)->n_descendants;
+          stack.push_back(make_pair(child, depth + 1));
+        }
+        double imbalance = _split_imbalance(sizes[0], sizes[1]);
+        stats->imbalance[std::min(9, (int)((imbalance - 0.5) * 20))]++;
+        stats->mean_imbalance += imbalance;
+        stats->n_split_nodes++;
+        path.push_back(i);
+        continue;
+      }
+
+      const S* dst = &i;
+      S n = 1;
+      if (i >= _n_item_slots) {
+        dst = _leaf_items(node, _bucket_data());
+        n = node->n_descendants;
+      }
+      if (stats->depths.size() <= depth)
+        stats->depths.resize(depth + 1, 0);
+      stats->depths[depth]++;
+      if (stats->leaf_sizes.size() <= (size_t)n)
+        stats->leaf_sizes.resize(n + 1, 0);
+      stats->leaf_sizes[n]++;
+      stats->n_leaves++;
+
+      for (S j = 0; j < n; j++) {
+        if (_get(dst[j])->n_descendants != 1)
+          continue; // Deleted, or padding in a root
+        const Node* item = _projected_f ? get_node_ptr<S, Node>(&(*projected)[0], _ps, dst[j]) : _get(dst[j]);
+        for (size_t k = 0; k < path.size(); k++) {
+          S child = k + 1 < path.size() ? path[k + 1] : i;
+          const Node* split = _get(path[k]);
+          if (D::side(split, item, _split_f(), random) != (split->children[1] == child))
+            random_split[path[k] - _n_item_slots] = 1;
+        }
+      }
+    }
+
+    for (size_t i = 0; i < random_split.size(); i++)
+      stats->n_random_splits += random_split[i];
+    if (stats->n_split_nodes > 0)
+      stats->mean_imbalance /= stats->n_split_nodes;
+    return true;
+  }
+
+  void get_candidate_stats(size_t n_queries, size_t n, int search_k, AnnoyCandidateStats* stats) const {
+    // Queries with up to n_queries items, spread evenly over the ids. Candidates that several trees return are only
+    // compared once, so trees that return the same items find fewer distinct candidates for the same search_k.
+    stats->n_queries = stats->n_candidates = stats->n_unique = 0;
+    if (search_k == -1)
+      search_k = n * _roots.size();
+    n_queries = std::min(n_queries, (size_t)_n_items);
+    vector<S> nns;
+    for (size_t q = 0; q < n_queries; q++) {
+      const Node* item = _get((S)(q * (size_t)_n_items / n_queries));
+      if (item->n_descendants != 1)
+        continue;
+      nns.clear();
+      _get_candidates(item->v, search_k, &nns);
+      std::sort(nns.begin(), nns.end());
+      stats->n_queries++;
+      stats->n_candidates += nns.size();
+      stats->n_unique += std::unique(nns.begin(), nns.end()) - nns.begin();
+    }
+  }
+
+  void verbose(bool v) {
+    _verbose = v;
+  }
+
+  void get_item(S item, T* v) const {
+    // TODO: handle OOB
+    Node* m = _get(item);
+    memcpy(v, m->v, (_f) * sizeof(T));
+  }
+
+  const T* get_item_vectors(size_t* stride) const {
+    // Returns the vector of item 0, which the vector of item i follows by i * stride bytes. The pointer
+    // is valid until the index is changed or unloaded, and ids without items have zeros or stale vectors.
+    *stride = _s;
+    return _nodes ? _get(0)->v : NULL;
+  }
+
+  void set_seed(R seed) {
+    _seed = seed;
+  }
+
+  bool set_split_sample_size(size_t n, char** error=NULL) {
+    // Splits of more than n items are found and checked for balance on a random sample of n items,
+    // and then all items are assigned to a side once. 0 uses all items, which is the default.
+    if (n == 1) {
+      set_error_from_string(error, "The split sample size must be 0 or at least 2");
+      return false;
+    }
+    _split_sample_size = n;
+    return true;
+  }
+
+  void set_out_of_core_memory(size_t memory) {
+    // For indexes that don't fit in memory, typically built with on_disk_build. With a nonzero memory, the splits of
+    // large nodes are picked from samples, and their items are assigned to a side in a pass that reads them in the
+    // order they are stored in. Subtrees with few enough items are built from a copy of their items in memory.
+    // The threads share the memory, and 0 (the default) turns this off.
+    _out_of_core_memory = memory;
+  }
+
+  bool set_projection(int n_components, char** error=NULL) {
+    // Builds learn the directions in which the items vary most (their principal components), and make the splits on
+    // the projections of the items onto the top n_components of them. Queries go down the trees with the projected
+    // query, but the candidates are still ranked by their full vectors. 0 (the default) uses the item vectors.
+    if (n_components != 0 && numeric_limits<T>::is_integer) {
+      set_error_from_string(error, "Projections need vectors of floating point numbers");
+      return false;
+    }
+    if (n_components < 0 || n_components > _f) {
+      set_error_from_string(error, "The number of components must be between 0 and the number of dimensions");
+      return false;
+    }
+    if (_built || _loaded) {
+      set_error_from_string(error, "You can't set a projection for a built or loaded index");
+      return false;
+    }
+    _n_components = n_components;
+    return true;
+  }
+
+  int get_projection(T* components) const {
+    // Copies the components of the projection, if components isn't NULL, and returns how many there are
+    if (components && _projected_f)
+      memcpy(components, &_projection[0], _projection.size() * sizeof(T));
+    return _projected_f;
+  }
+
+  S get_max_leaf_size() const {
+    return _K;
+  }
+
+  void set_deterministic_build(bool deterministic) {
+    // Makes build and add_trees give the same index, byte for byte, for the same seed and items, however many threads
+    // build it and however they're scheduled. Each tree is seeded by its number rather than by the thread building it,
+    // and the nodes are numbered in the order of the trees once they're built. This changes the trees compared to
+    // builds that aren't deterministic, and costs a pass over the new nodes.
+    _deterministic = deterministic;
+  }
+
+  void set_build_callback(AnnoyBuildCallback callback, void* arg=NULL) {
+    // The callback gets the progress after every tree, and at most once a second while building trees.
+    // Returning false from it cancels the build, like cancel_build.
+    _build_callback = callback;
+    _build_callback_arg = arg;
+  }
+
+  void cancel_build() {
+    // Stops the build that is running, which then returns an error and leaves the index as it was before.
+    // This can be called from any thread, and does nothing if no build is running.
+    if (_building)
+      _cancelled = true;
+  }
+
+  void thread_build(int q, int thread_idx, ThreadedBuildPolicy& threaded_build_policy) {
+    // Each thread needs its own seed, otherwise each thread would be building the same tree(s)
+    Random _random(_build_seed + thread_idx);
+
+    vector<S> thread_roots;
+    vector<size_t> thread_trees;
+    vector<S> indices;
+    _Scratch scratch;
+    while (!_cancelled) {
+      if (q == -1) {
+        // Counts the nodes in all blocks reserved so far, except the unused part of our own last block.
+        // This is exact with one thread, and a slight overestimate with more.
+        size_t n_nodes = (size_t)_n_nodes + threaded_build_policy.n_reserved_blocks() * _node_block_size();
+        if (!_arenas[thread_idx].empty())
+          n_nodes -= _node_block_size() - _arenas[thread_idx].back().n_nodes;
+        if (n_nodes >= 2 * (size_t)_n_items) {
+          break;
+        }
+      } else if (!_deterministic) {
+        if (thread_roots.size() >= (size_t)q) {
+          break;
+        }
+      }
+
+      if (_deterministic) {
+        // Every tree we take a number for has to be built, since _renumber_trees keeps them in order
+        threaded_build_policy.lock_roots();
+        size_t tree = _n_trees_taken++;
+        threaded_build_policy.unlock_roots();
+        if (_build_q != -1 && tree >= (size_t)_build_q)
+          break;
+        _random = Random(_build_seed + (R)tree);
+        thread_trees.push_back(tree);
+      }
+
+      if (_verbose) annoylib_showUpdate("pass %zd...\n", thread_roots.size());
+
+      // _make_tree partitions the indices in place, so we refill them for every tree
+      indices.clear();
+      for (S i = 0; i < _n_items; i++) {
+        if (_get(i)->n_descendants >= 1) { // Issue #223
+          indices.push_back(i);
+        }
+      }
+
+      S* tree_indices = indices.empty() ? NULL : &indices[0];
+      thread_roots.push_back(_make_tree(tree_indices, indices.size(), true, _random, scratch, threaded_build_policy));
+      _report_progress(true, threaded_build_policy);
+    }
+
+    threaded_build_policy.lock_roots();
+    if (_deterministic) {
+      for (size_t i = 0; i < thread_roots.size(); i++)
+        _tree_roots.push_back(make_pair(thread_trees[i], thread_roots[i]));
+    } else {
+      _roots.insert(_roots.end(), thread_roots.begin(), thread_roots.end());
+    }
+    threaded_build_policy.unlock_roots();
+  }
+
+protected:
+  template<typename W>
+  void _set_item(S item, const W& w) {
+    Node* n = _get(item);
+
+    D::zero_value(n);
+
+    n->children[0] = 0;
+    n->children[1] = 0;
+    n->n_descendants = 1;
+
+    for (int z = 0; z < _f; z++)
+      n->v[z] = w[z];
+
+    D::init_node(n, _f);
+  }
+
+  struct _QueriesTask {
+    const AnnoyIndex* annoy;
+    const T* w;
+    size_t n;
+    int search_k;
+    S* result;
+    T* distances;
+
+    void operator()(size_t begin, size_t end) const {
+      vector<S> nns;
+      vector<T> nns_dist;
+      for (size_t q = begin; q < end; q++) {
+        nns.clear();
+        nns_dist.clear();
+        annoy->_get_all_nns(w + q * annoy->_f, n, search_k, &nns, distances ? &nns_dist : NULL);
+        for (size_t i = 0; i < n; i++) {
+          result[q * n + i] = i < nns.size() ? nns[i] : (S)-1;
+          if (distances)
+            distances[q * n + i] = i < nns.size() ? nns_dist[i] : numeric_limits<T>::quiet_NaN();
+        }
+      }
+    }
+  };
+
+  template<typename W>
+  struct _AddItemsTask {
+    AnnoyIndex* annoy;
+    const S* items;  // NULL to add consecutive items, starting with first_item
+    S first_item;
+    const char* rows;
+    size_t stride;  // Number of bytes from one row to the next
+
+    void operator()(size_t begin, size_t end) const {
+      for (size_t i = begin; i < end; i++)
+        annoy->_set_item(items ? items[i] : first_item + (S)i, (const W*)(rows + i * stride));
+    }
+  };
+
+  bool _prepare_build(char** error) {
+    if (_loaded) {
+      set_error_from_string(error, "You can't build a loaded index");
+      return false;
+    }
+
+    if (_built) {
+      set_error_from_string(error, "You can't build a built index");
+      return false;
+    }
+
+    D::template preprocess<T, S, Node>(_nodes, _s, _n_items, _f);
+
+    _n_nodes = _n_items;
+    _n_item_slots = _n_items;
+    if (_n_components > 0) {
+      _learn_projection();
+      _project_items(&_projected_items);
+    }
+    return true;
+  }
+
+  bool _finish_build(char** error) {
+    vector<char>().swap(_projected_items); // _ensure_projected_items makes them again if needed
+    if (!_append_root_copies(error))
+      return false;
+
+    D::template postprocess<T, S, Node>(_nodes, _s, _n_items, _f);
+
+    _built = true;
+    return true;
+  }
+
+  bool _append_root_copies(char** error) {
+    // load() expects the last copy to be the copy of the node right before the copies, if that's a root
+    // (see the hacky fix there), which isn't the case when the last trees were built by several threads
+    for (size_t i = 0; i + 1 < _roots.size(); i++) {
+      if (_roots[i] == _n_nodes - 1) {
+        std::swap(_roots[i], _roots.back());
+        break;
+      }
+    }
+
+    // Also, copy the roots into the last segment of the array
+    // This way we can load them faster without reading the whole file
+    _allocate_size(_n_nodes + (S)_roots.size());
+    for (size_t i = 0; i < _roots.size(); i++)
+      memcpy(_get(_n_nodes + (S)i), _get(_roots[i]), _s);
+    _n_nodes += _roots.size();
+
+    // With another leaf size than the default, the buckets go after the nodes, followed by a footer node with
+    // -1 descendants, which load() can't mistake for a root. Other indexes stay the same as they always were.
+    // A projection goes before the buckets, followed by a node with -2 descendants.
+    _n_footer_nodes = 0;
+    if ((size_t)_n_nodes + _n_footer_nodes_for(_buckets.size()) > (size_t)numeric_limits<S>::max()) {
+      _n_nodes -= (S)_roots.size();
+      set_error_from_string(error, "The index has more nodes than the item type can count");
+      return false;
+    }
+    if (_K != _leaf_capacity || !_buckets.empty() || _projected_f) {
+      S n_projection_nodes = _projected_f ? (S)((_projection.size() * sizeof(T) + _s - 1) / _s) + 1 : 0;
+      S n_bucket_nodes = (S)((_buckets.size() * sizeof(S) + _s - 1) / _s);
+      _n_footer_nodes = n_projection_nodes + n_bucket_nodes + 1;
+      _allocate_size(_n_nodes + _n_footer_nodes);
+      memset(_get(_n_nodes), 0, _s * (size_t)_n_footer_nodes);
+      if (_projected_f) {
+        memcpy(_get(_n_nodes), &_projection[0], _projection.size() * sizeof(T));
+        Node* header = _get(_n_nodes + n_projection_nodes - 1);
+        header->n_descendants = (S)-2;
+        header->children[0] = _projected_f;
+        header->children[1] = n_projection_nodes - 1;
+      }
+      S buckets_begin = _n_nodes + n_projection_nodes;
+      if (!_buckets.empty())
+        memcpy(_get(buckets_begin), &_buckets[0], _buckets.size() * sizeof(S));
+      Node* footer = _get(buckets_begin + n_bucket_nodes);
+      footer->n_descendants = (S)-1;
+      footer->children[0] = _K;
+      footer->children[1] = n_bucket_nodes;
+    }
+
+    if (_verbose) annoylib_showUpdate("has %d nodes\n", _n_nodes);
+    
+    if (_on_disk) {
+      if (!remap_memory_and_truncate(&_nodes, _fd,
+          static_cast<size_t>(_s) * static_cast<size_t>(_nodes_size),
+          static_cast<size_t>(_s) * static_cast<size_t>(_n_nodes + _n_footer_nodes))) {
+        // TODO: this probably creates an index in a corrupt state... not sure what to do
+        set_error_from_errno(error, "Unable to truncate");
+        return false;
+      }
+      _nodes_size = _n_nodes + _n_footer_nodes;
+    }
+    return true;
+  }
+
+  size_t _n_footer_nodes_for(size_t n_bucket_ids) const {
+    // The nodes _append_root_copies writes after the copies of the roots
+    if (_K == _leaf_capacity && n_bucket_ids == 0 && !_projected_f)
+      return 0;
+    size_t n_projection_nodes = _projected_f ? (_projection.size() * sizeof(T) + _s - 1) / _s + 1 : 0;
+    return n_projection_nodes + (n_bucket_ids * sizeof(S) + _s - 1) / _s + 1;
+  }
+
+  bool _read_footer(char** error) {
+    // See _append_root_copies. Files without a footer have the default leaf size, and no projection.
+    _K = _leaf_capacity;
+    _set_projected_f(0);
+    if (_n_nodes == 0 || _get(_n_nodes - 1)->n_descendants != (S)-1)
+      return true;
+    S n_nodes = _n_nodes;
+    const Node* footer = _get(_n_nodes - 1);
+    S n_bucket_nodes = footer->children[1];
+    if (footer->children[0] < 2 || n_bucket_nodes < 0 || n_bucket_nodes >= _n_nodes - 1) {
+      set_error_from_string(error, "Index has a corrupt footer");
+      return false;
+    }
+    _K = footer->children[0];
+    _n_nodes -= n_bucket_nodes + 1;
+    _loaded_buckets = (const S*)_get(_n_nodes);
+    _n_loaded_buckets = _s * (size_t)n_bucket_nodes / sizeof(S);
+
+    if (_n_nodes > 0 && _get(_n_nodes - 1)->n_descendants == (S)-2) {
+      const Node* header = _get(_n_nodes - 1);
+      int n_components = (int)header->children[0];
+      S n_projection_nodes = header->children[1];
+      if (n_components < 1 || n_components > _f || n_projection_nodes < 0 || n_projection_nodes >= _n_nodes - 1 ||
+          _s * (size_t)n_projection_nodes < sizeof(T) * n_components * _f) {
+        set_error_from_string(error, "Index has a corrupt projection");
+        return false;
+      }
+      _n_nodes -= n_projection_nodes + 1;
+      _set_projected_f(n_components);
+      const T* components = (const T*)_get(_n_nodes);
+      _projection.assign(components, components + (size_t)n_components * _f);
+    }
+    _n_footer_nodes = n_nodes - _n_nodes;
+    return true;
+  }
+
+  void _set_projected_f(int n_components) {
+    _projected_f = n_components;
+    _ps = offsetof(Node, v) + n_components * sizeof(T);
+    _projection.clear();
+    vector<char>().swap(_projected_items);
+  }
+
+  int _split_f() const {
+    // The number of dimensions of the splits, and of the items they're made on
+    return _projected_f ? _projected_f : _f;
+  }
+
+  size_t _split_s() const {
+    return _projected_f ? _ps : _s;
+  }
+
+  Node* _split_item(S item) const {
+    // The item as the splits see it, see set_projection
+    return _projected_f ? get_node_ptr<S, Node>(&_projected_items[0], _ps, item) : _get(item);
+  }
+
+  void _learn_projection() {
+    // The top principal components of a sample of the items, by orthogonal iteration on their covariance matrix.
+    // The projection doesn't subtract the mean, so hyperplanes through the origin in the projection go through it
+    // in the item space too, which angular distance needs.
+    const int d = _n_components;
+    Random random(_seed);
+    vector<S> sample;
+    for (S i = 0; i < _n_items && sample.size() < ANNOYLIB_PROJECTION_SAMPLE_SIZE; i++) {
+      S j = _n_items <= ANNOYLIB_PROJECTION_SAMPLE_SIZE ? i : (S)random.index(_n_items);
+      if (_get(j)->n_descendants == 1)
+        sample.push_back(j);
+    }
+
+    vector<double> mean(_f, 0.0), cov((size_t)_f * _f, 0.0), x(_f);
+    for (size_t i = 0; i < sample.size(); i++) {
+      const T* v = _get(sample[i])->v;
+      for (int z = 0; z < _f; z++)
+        mean[z] += v[z];
+    }
+    for (int z = 0; z < _f; z++)
+      mean[z] /= std::max((size_t)1, sample.size());
+    for (size_t i = 0; i < sample.size(); i++) {
+      const T* v = _get(sample[i])->v;
+      for (int z = 0; z < _f; z++)
+        x[z] = v[z] - mean[z];
+      for (int a = 0; a < _f; a++)
+        for (int b = a; b < _f; b++)
+          cov[(size_t)a * _f + b] += x[a] * x[b];
+    }
+    for (int a = 0; a < _f; a++)
+      for (int b = 0; b < a; b++)
+        cov[(size_t)a * _f + b] = cov[(size_t)b * _f + a];
+
+    vector<double> q((size_t)d * _f), z((size_t)d * _f);
+    for (size_t i = 0; i < q.size(); i++)
+      q[i] = random.flip() ? 1.0 : -1.0;
+    _orthonormalize(&q, d);
+    for (int iteration = 0; iteration < ANNOYLIB_PROJECTION_ITERATIONS; iteration++) {
+      for (int k = 0; k < d; k++) {
+        for (int a = 0; a < _f; a++) {
+          double sum = 0;
+          for (int b = 0; b < _f; b++)
+            sum += cov[(size_t)a * _f + b] * q[(size_t)k * _f + b];
+          z[(size_t)k * _f + a] = sum;
+        }
+      }
+      q.swap(z);
+      _orthonormalize(&q, d);
+    }
+
+    _set_projected_f(d);
+    _projection.assign(q.begin(), q.end());
+  }
+
+  void _orthonormalize(vector<double>* rows, int n_rows) const {
+    // Gram-Schmidt. Rows that depend on the ones before become zero, and then project everything to 0.
+    double* r = &(*rows)[0];
+    for (int k = 0; k < n_rows; k++) {
+      for (int l = 0; l < k; l++) {
+        double d = 0;
+        for (int z = 0; z < _f; z++)
+          d += r[(size_t)k * _f + z] * r[(size_t)l * _f + z];
+        for (int z = 0; z < _f; z++)
+          r[(size_t)k * _f + z] -= d * r[(size_t)l * _f + z];
+      }
+      double norm = 0;
+      for (int z = 0; z < _f; z++)
+        norm += r[(size_t)k * _f + z] * r[(size_t)k * _f + z];
+      norm = sqrt(norm);
+      for (int z = 0; z < _f; z++)
+        r[(size_t)k * _f + z] = norm > 1e-12 ? r[(size_t)k * _f + z] / norm : 0;
+    }
+  }
+
+  void _project(const T* v, T* projected) const {
+    for (int k = 0; k < _projected_f; k++)
+      projected[k] = dot(&_projection[(size_t)k * _f], v, _f);
+  }
+
+  void _project_item(S item, void* projected_items) const {
+    Node* n = get_node_ptr<S, Node>(projected_items, _ps, item);
+    D::zero_value(n);
+    n->n_descendants = _get(item)->n_descendants;
+    _project(_get(item)->v, n->v);
+    D::init_node(n, _projected_f);
+  }
+
+  void _project_items(vector<char>* projected_items) const {
+    projected_items->assign((size_t)_n_item_slots * _ps, 0);
+    if (_n_item_slots == 0)
+      return;
+    for (S i = 0; i < _n_item_slots; i++)
+      _project_item(i, &(*projected_items)[0]);
+    D::template preprocess<T, S, Node>(&(*projected_items)[0], _ps, _n_items, _projected_f);
+  }
+
+  void _ensure_projected_items() {
+    // For changes to a built index. The projected items are dropped after builds, and don't follow new item slots.
+    if (_projected_f && _projected_items.size() != (size_t)_n_item_slots * _ps)
+      _project_items(&_projected_items);
+  }
+
+  const S* _bucket_data() const {
+    return _loaded ? _loaded_buckets : (_buckets.empty() ? NULL : &_buckets[0]);
+  }
+
+  size_t _n_bucket_ids() const {
+    return _loaded ? _n_loaded_buckets : _buckets.size();
+  }
+
+  const S* _leaf_items(const Node* leaf, const S* buckets) const {
+    // Leaves with more items than fit into a node point to their items in the buckets, see _bucket_offset
+    return leaf->n_descendants > _leaf_capacity ? buckets + _bucket_offset(leaf) : leaf->children;
+  }
+
+  size_t _bucket_offset(const Node* leaf) const {
+    // The buckets can hold more ids than S counts, so the offset is split over both children
+    if (sizeof(S) >= sizeof(size_t))
+      return (size_t)leaf->children[0];
+    const size_t mask = ~(size_t)0 >> (8 * (sizeof(size_t) - sizeof(S)));
+    return ((size_t)leaf->children[0] & mask) + ((size_t)leaf->children[1] & mask) * (mask + 1);
+  }
+
+  void _set_bucket_offset(Node* leaf, size_t offset) const {
+    if (sizeof(S) >= sizeof(size_t)) {
+      leaf->children[0] = (S)offset;
+      return;
+    }
+    const size_t mask = ~(size_t)0 >> (8 * (sizeof(size_t) - sizeof(S)));
+    leaf->children[0] = (S)(offset & mask);
+    leaf->children[1] = (S)(offset / (mask + 1));
+  }
+
+  void _set_leaf(Node* leaf, const S* items, size_t n, S n_descendants, vector<S>* buckets) const {
+    // Roots that are leaves have _n_items descendants, even if some items are missing, so their lists are padded
+    // with zeros. Nodes with more than _K descendants aren't leaves, so we leave them alone.
+    leaf->n_descendants = n_descendants;
+    if (n_descendants > _leaf_capacity && n_descendants <= _K) {
+      _set_bucket_offset(leaf, buckets->size());
+      if (n > 0)
+        buckets->insert(buckets->end(), items, items + n);
+      buckets->resize(buckets->size() + (size_t)n_descendants - n, 0);
+    } else if (n > 0) {
+      // Using std::copy instead of a loop seems to resolve issues #3 and #13,
+      // probably because gcc 4.8 goes overboard with optimizations.
+      // Using memcpy instead of std::copy for MSVC compatibility. #235
+      // Only copy when necessary to avoid crash in MSVC 9. #293
+      memcpy(leaf->children, items, n * sizeof(S));
+    }
+  }
+
+  S _append_trees(const AnnoyIndex* other) {
+    // Copies the nodes and buckets of the trees of other behind our nodes, and returns the offset to add
+    // to the node ids of other. The item ids in the leaves are copied as they are.
+    S other_begin = other->_n_item_slots;
+    S other_end = other->_n_nodes - (S)other->_roots.size();
+    S offset = _n_nodes - other_begin;
+    size_t bucket_offset = _buckets.size();
+    _buckets.insert(_buckets.end(), other->_bucket_data(), other->_bucket_data() + other->_n_bucket_ids());
+    _allocate_size(_n_nodes + (other_end - other_begin));
+    memcpy(_get(_n_nodes), other->_get(other_begin), _s * (size_t)(other_end - other_begin));
+    for (S i = _n_nodes; i < _n_nodes + (other_end - other_begin); i++) {
+      Node* node = _get(i);
+      if (node->n_descendants > _K) {
+        for (int side = 0; side < 2; side++) {
+          if (node->children[side] >= other_begin)
+            node->children[side] += offset;
+        }
+      } else if (node->n_descendants > _leaf_capacity) {
+        _set_bucket_offset(node, _bucket_offset(node) + bucket_offset);
+      }
+    }
+    _n_nodes += other_end - other_begin;
+    return offset;
+  }
+
+  bool _find_roots(vector<S>* roots, char** error) const {
+    // After loading, _roots are the copies of the roots at the end, so we look for the identical nodes
+    // in the trees, which have _n_items descendants.
+    S n_trees_end = _n_nodes - (S)_roots.size();
+    *roots = _roots;
+    if (!_loaded)
+      return true;
+    vector<S> candidates;
+    for (S j = _n_items; j < n_trees_end; j++) {
+      if (_get(j)->n_descendants == _n_items)
+        candidates.push_back(j);
+    }
+    for (size_t i = 0; i < roots->size(); i++) {
+      size_t c = 0;
+      while (c < candidates.size() && memcmp(_get(candidates[c]), _get((*roots)[i]), _s))
+        c++;
+      if (c == candidates.size()) {
+        set_error_from_string(error, "Unable to find the roots of the index");
+        return false;
+      }
+      (*roots)[i] = candidates[c];
+      candidates.erase(candidates.begin() + c);
+    }
+    return true;
+  }
+
+  bool _copy_to_memory(char** error, const char* file=NULL) {
+    // Replaces the mmapped index by a copy on the heap that we can change, or in file (see on_disk_build)
+    vector<S> roots;
+    if (!_find_roots(&roots, error))
+      return false;
+
+    // The buckets and footer stay after the nodes, so that saving without changing the trees writes them again
+    size_t n_nodes = (size_t)(_n_nodes + _n_footer_nodes);
+    void* nodes;
+    int fd = 0;
+    if (file) {
+#ifndef _MSC_VER
+      fd = open(file, O_RDWR | O_CREAT | O_TRUNC, (int) 0600);
+#else
+      fd = _open(file, _O_RDWR | _O_CREAT | _O_TRUNC, (int) 0600);
+#endif
+      if (fd == -1) {
+        set_error_from_errno(error, "Unable to open");
+        return false;
+      }
+      nodes = MAP_FAILED;
+      if (ftruncate(fd, ANNOYLIB_FTRUNCATE_SIZE(_s) * ANNOYLIB_FTRUNCATE_SIZE(n_nodes)) != -1)
+        nodes = mmap(0, _s * n_nodes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (nodes == MAP_FAILED) {
+        set_error_from_errno(error, "Unable to map");
+#ifndef _MSC_VER
+        close(fd);
+#else
+        _close(fd);
+#endif
+        return false;
+      }
+    } else {
+      nodes = malloc(_s * n_nodes);
+      if (!nodes) {
+        set_error_from_string(error, "Unable to allocate memory for the index");
+        return false;
+      }
+    }
+    _roots = roots;
+    _prefaulter.stop();
+    memcpy(nodes, _nodes, _s * n_nodes);
+    _buckets.assign(_loaded_buckets, _loaded_buckets + _n_loaded_buckets);
+    _loaded_buckets = NULL;
+    _n_loaded_buckets = 0;
+#ifndef _MSC_VER
+    close(_fd);
+#else
+    _close(_fd);
+#endif
+    munmap(_nodes, _s * n_nodes);
+    _fd = fd;
+    _on_disk = file != NULL;
+    _nodes = nodes;
+    _nodes_size = (S)n_nodes;
+    _loaded = false;
+    return true;
+  }
+
+  void _add_item_slots(S n) {
+    // Items need ids below the nodes of the trees, so we move the trees up to make room for n items,
+    // plus some more, so that inserting consecutive items only moves the trees every now and then
+    S n_slots = n + std::max((S)64, _n_items / 16);
+    S shift = n_slots - _n_item_slots;
+    S n_tree_nodes = _n_nodes - _n_item_slots;
+    _allocate_size(_n_nodes + shift);
+    memmove(_get(n_slots), _get(_n_item_slots), _s * (size_t)n_tree_nodes);
+    memset(_get(_n_item_slots), 0, _s * (size_t)shift);
+
+    for (S i = n_slots; i < n_slots + n_tree_nodes; i++) {
+      Node* node = _get(i);
+      if (node->n_descendants > _K) {
+        for (int side = 0; side < 2; side++) {
+          if (node->children[side] >= _n_item_slots)
+            node->children[side] += shift;
+        }
+      }
+    }
+    for (size_t i = 0; i < _roots.size(); i++)
+      _roots[i] += shift;
+    _n_nodes += shift;
+    _n_item_slots = n_slots;
+  }
+
+  S _compact_tree(S i, vector<char>* nodes, vector<S>* buckets, S* n_descendants) {
+    // Appends the nodes of the compacted subtree to nodes, numbered from _n_item_slots, and returns its top.
+    // Like in _make_tree, a subtree of a single item is just that item, and it's empty if n_descendants is 0.
+    const Node* node = _get(i);
+    if (i < _n_item_slots) {
+      *n_descendants = node->n_descendants == 1 ? 1 : 0;
+      return i;
+    }
+
+    vector<S> items;
+    size_t n_nodes_before = nodes->size() / _s;
+    if (node->n_descendants <= _K) {
+      const S* dst = _leaf_items(node, _bucket_data());
+      for (S j = 0; j < node->n_descendants; j++) {
+        if (_get(dst[j])->n_descendants == 1)
+          items.push_back(dst[j]);
+      }
+    } else {
+      S children[2], n_children[2];
+      for (int side = 0; side < 2; side++)
+        children[side] = _compact_tree(node->children[side], nodes, buckets, &n_children[side]);
+      if (n_children[0] == 0 || n_children[1] == 0) {
+        int side = n_children[0] == 0 ? 1 : 0;
+        *n_descendants = n_children[side];
+        return children[side];
+      }
+
+      *n_descendants = n_children[0] + n_children[1];
+      if (*n_descendants > _K) {
+        nodes->resize(nodes->size() + _s);
+        Node* split = (Node*)&(*nodes)[nodes->size() - _s];
+        memcpy(split, node, _s);
+        split->n_descendants = *n_descendants;
+        split->children[0] = children[0];
+        split->children[1] = children[1];
+        return _n_item_slots + (S)(nodes->size() / _s - 1);
+      }
+
+      // Both sides are leaves or items now, which we merge into one leaf
+      for (int side = 0; side < 2; side++) {
+        if (n_children[side] == 1) {
+          items.push_back(children[side]);
+        } else {
+          const Node* leaf = (const Node*)&(*nodes)[(children[side] - _n_item_slots) * _s];
+          const S* dst = _leaf_items(leaf, buckets->empty() ? NULL : &(*buckets)[0]);
+          items.insert(items.end(), dst, &dst[leaf->n_descendants]);
+        }
+      }
+      nodes->resize(n_nodes_before * _s);
+    }
+
+    *n_descendants = (S)items.size();
+    if (items.size() <= 1)
+      return items.empty() ? 0 : items[0];
+    nodes->resize(nodes->size() + _s, 0);
+    Node* leaf = (Node*)&(*nodes)[nodes->size() - _s];
+    _set_leaf(leaf, &items[0], items.size(), (S)items.size(), buckets);
+    return _n_item_slots + (S)(nodes->size() / _s - 1);
+  }
+
+  void _insert_into_tree(S root, S item, Random& random) {
+    // Walks down the split nodes, counting the item as one of their descendants, and adds it to the leaf at the end.
+    // Split nodes can also point to a single item, which then turns into a leaf with both items.
+    S i = root;
+    while (true) {
+      Node* node = _get(i);
+      S n_descendants = node->n_descendants;
+      if (n_descendants <= _K)
+        break;
+      node->n_descendants = i == root ? _n_items : n_descendants + 1;
+      bool side = D::side(node, _split_item(item), _split_f(), random);
+      S child = node->children[side];
+      if (child < _n_item_slots) {
+        _allocate_size(_n_nodes + 1);
+        Node* leaf = _get(_n_nodes);
+        memset(leaf, 0, _s);
+        leaf->n_descendants = 2;
+        leaf->children[0] = child;
+        leaf->children[1] = item;
+        _get(i)->children[side] = _n_nodes++;
+        return;
+      }
+      i = child;
+    }
+
+    Node* leaf = _get(i);
+    const S* dst = _leaf_items(leaf, _bucket_data());
+    if (i != root && leaf->n_descendants < _K) {
+      bool in_bucket = leaf->n_descendants > _leaf_capacity;
+      size_t end = in_bucket ? _bucket_offset(leaf) + leaf->n_descendants : 0;
+      if (leaf->n_descendants < _leaf_capacity) {
+        S* children = leaf->children;
+        children[leaf->n_descendants++] = item;
+      } else if (in_bucket && end == _buckets.size()) {
+        // The bucket is the last one, so it can grow
+        _buckets.push_back(item);
+        leaf->n_descendants++;
+      } else if (in_bucket && _buckets[end] == (S)-1) {
+        _buckets[end] = item;
+        leaf->n_descendants++;
+      } else {
+        // The items move to a new bucket at the end, with room for as many more until the leaf is full. The room
+        // is marked with -1, which no item has, so that we can tell it apart from the next bucket.
+        vector<S> items(dst, &dst[leaf->n_descendants]);
+        items.push_back(item);
+        _set_leaf(leaf, &items[0], items.size(), (S)items.size(), &_buckets);
+        _buckets.resize(_buckets.size() + std::min(items.size(), (size_t)_K - items.size()), (S)-1);
+      }
+      return;
+    }
+
+    // The leaf is full, so we replace it by a tree of its items. Leaves that are roots list all items
+    // (except missing ones), and may have to turn into a split node because there are now more than _K.
+    vector<S> indices;
+    if (i == root) {
+      for (S j = 0; j < _n_items; j++) {
+        if (_get(j)->n_descendants == 1)
+          indices.push_back(j);
+      }
+    } else {
+      indices.assign(dst, &dst[leaf->n_descendants]);
+      indices.push_back(item);
+    }
+
+    // The top node of the tree is the last one created, and takes the place of the leaf
+    S top = _make_subtree(indices, i == root, random);
+    memcpy(_get(i), _get(top), _s);
+    _n_nodes--;
+  }
+
+  bool _remove_from_tree(S i, S item, bool is_root, Random& random, S* replacement) {
+    // Removes a deleted item from the tree below node i, see insert_item. We go down the side the item falls
+    // into first, and only look at the other side if it isn't there (splits that failed put items on random
+    // sides). Returns whether it was found, and sets *replacement to the node or item that takes the place of i.
+    Node* node = _get(i);
+    *replacement = i;
+    if (node->n_descendants <= _K) {
+      // Leaves that are roots list all items, and insert_item makes them again from the items that are left
+      if (is_root)
+        return true;
+      const S* dst = _leaf_items(node, _bucket_data());
+      vector<S> items(dst, &dst[node->n_descendants]);
+      typename vector<S>::iterator it = std::find(items.begin(), items.end(), item);
+      if (it == items.end())
+        return false;
+      items.erase(it);
+      if (items.size() == 1) {
+        // The leaf node is left unused
+        *replacement = items[0];
+        return true;
+      }
+      if ((S)items.size() > _leaf_capacity) {
+        // The bucket keeps its place, with room for one more item at the end, see _insert_into_tree
+        S* bucket = &_buckets[_bucket_offset(node)];
+        std::copy(items.begin(), items.end(), bucket);
+        bucket[items.size()] = (S)-1;
+        node->n_descendants--;
+        return true;
+      }
+      _set_leaf(node, &items[0], items.size(), (S)items.size(), &_buckets);
+      return true;
+    }
+
+    int side = D::side(node, _split_item(item), _split_f(), random);
+    for (int k = 0; k < 2; k++, side = 1 - side) {
+      S child = node->children[side];
+      S new_child;
+      if (child == item) {
+        // The split node isn't needed anymore. Roots keep their place, and take the other side's node.
+        if (is_root)
+          memcpy(node, _get(node->children[1 - side]), _s);
+        else
+          *replacement = node->children[1 - side];
+        return true;
+      }
+      if (child < _n_item_slots || !_remove_from_tree(child, item, false, random, &new_child))
+        continue;
+      node = _get(i);
+      node->children[side] = new_child;
+      if (!is_root && --node->n_descendants <= _K) {
+        // Too few items for a split node, so it becomes a leaf
+        vector<S> items;
+        _get_subtree_items(node->children[0], &items);
+        _get_subtree_items(node->children[1], &items);
+        _set_leaf(node, &items[0], items.size(), (S)items.size(), &_buckets);
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void _get_subtree_items(S i, vector<S>* items) const {
+    const Node* node = _get(i);
+    if (i < _n_item_slots) {
+      items->push_back(i);
+    } else if (node->n_descendants <= _K) {
+      const S* dst = _leaf_items(node, _bucket_data());
+      items->insert(items->end(), dst, &dst[node->n_descendants]);
+    } else {
+      _get_subtree_items(node->children[0], items);
+      _get_subtree_items(node->children[1], items);
+    }
+  }
+
+  void _clear_deleted() {
+    // Deleted items aren't in any trees anymore, see mark_deleted
+    for (S i = 0; i < _n_items; i++) {
+      if (_get(i)->n_descendants == 0)
+        _get(i)->children[0] = 0;
+    }
+  }
+
+  S _make_subtree(vector<S>& indices, bool is_root, Random& random) {
+    // Builds a tree of the indices outside of build(), and appends its nodes to the index
+    ThreadedBuildPolicy threaded_build_policy;
+    _Scratch scratch;
+    size_t n_roots = _roots.size();
+    _arenas.assign(1, vector<_NodeBlock>());
+    S* tree_indices = indices.empty() ? NULL : &indices[0];
+    _roots.push_back(_make_tree(tree_indices, indices.size(), is_root, random, scratch, threaded_build_policy));
+    _compact_nodes(n_roots);
+    S top = _roots.back();
+    _roots.pop_back();
+    return top;
+  }
+
+  bool _build_trees(int q, int n_threads) {
+    // The nodes of the new trees go to blocks owned by the threads that create them, so that threads never
+    // wait for each other to allocate nodes, and the items they read never move. Each block gets a range of
+    // provisional ids, which we map to consecutive ids when copying the blocks into the index afterwards.
+    // With on_disk_build, the blocks are mapped from their ranges of the file (see _new_node_block).
+    n_threads = ThreadedBuildPolicy::resolve_n_threads(n_threads);
+    size_t n_roots = _roots.size();
+    S n_nodes = _n_nodes;
+    size_t n_buckets = _buckets.size();
+    _run_memory = _out_of_core_memory / n_threads;
+    _build_seed = _seed;
+    if (n_roots > 0) {
+      // Adding to existing trees, which we would just repeat with the same seeds
+      Random random(_seed + (R)n_roots);
+      _build_seed = _random_seed(random);
+    }
+
+    _progress.n_trees = 0;
+    _progress.n_trees_total = q == -1 ? 0 : (size_t)q;
+    _progress.n_nodes = 0;
+    _progress.elapsed = 0;
+    _progress.eta = -1;
+    _build_q = q;
+    _progress_start = _progress_reported = ThreadedBuildPolicy::now();
+
+    _n_trees_taken = 0;
+    _cancelled = false;
+    _building = true;
+    while (1) {
+      _arenas.assign(n_threads, vector<_NodeBlock>());
+      ThreadedBuildPolicy::template build<S, T>(this, q, n_threads);
+      if (_cancelled)
+        break;
+      if (!_deterministic) {
+        _compact_nodes(n_roots);
+        break;
+      }
+      std::sort(_tree_roots.begin(), _tree_roots.end());
+      for (size_t i = 0; i < _tree_roots.size(); i++)
+        _roots.push_back(_tree_roots[i].second);
+      _tree_roots.clear();
+      _compact_nodes(n_roots);
+      if (_renumber_trees(n_nodes, n_roots, n_buckets, q))
+        break;
+      // With q == -1, the threads stopped early, so we build more trees, and renumber all of them again
+    }
+    _building = false;
+
+    if (_cancelled) {
+      // Drops the new trees
+      for (size_t t = 0; t < _arenas.size(); t++)
+        for (size_t b = 0; b < _arenas[t].size(); b++)
+          _free_node_block(_arenas[t][b]);
+      _arenas.clear();
+      _roots.resize(n_roots);
+      _tree_roots.clear();
+      _buckets.resize(n_buckets);
+      _n_nodes = n_nodes;
+      _cancelled = false;
+      if (_verbose) annoylib_showUpdate("build cancelled\n");
+      return false;
+    }
+    return true;
+  }
+
+  bool _renumber_trees(S begin, size_t n_roots, size_t n_buckets, int q) {
+    // Copies the new trees one after the other in the order of their numbers, each one with the children of a node
+    // before the node, so that the ids don't depend on which thread built what. With q == -1, this keeps the trees
+    // that one thread would have built, and returns false if the threads should have built more.
+    vector<char> nodes;
+    vector<S> buckets;
+    size_t n_trees = 0;
+    for (size_t i = n_roots; i < _roots.size(); i++) {
+      if (q == -1 && (size_t)begin + nodes.size() / _s >= 2 * (size_t)_n_items)
+        break;
+      _roots[n_roots + n_trees++] = _renumber_subtree(_roots[i], begin, &nodes, n_buckets, &buckets);
+    }
+    _buckets.resize(n_buckets);
+    _buckets.insert(_buckets.end(), buckets.begin(), buckets.end());
+    bool done = q != -1 || n_roots + n_trees < _roots.size() || (size_t)begin + nodes.size() / _s >= 2 * (size_t)_n_items;
+
+    _roots.resize(n_roots + n_trees);
+    if (!nodes.empty())
+      memcpy(_get(begin), &nodes[0], nodes.size());
+    _n_nodes = begin + (S)(nodes.size() / _s);
+    return done;
   }
 
-  void get_nns_by_item(S item, size_t n, int search_k, vector<S>* result, vector<T>* distances) const {
-    // TODO: handle OOB
-    const Node* m = _get(item);
-    _get_all_nns(m->v, n, search_k, result, distances);
+  S _renumber_subtree(S i, S begin, vector<char>* nodes, size_t n_buckets, vector<S>* buckets) {
+    if (i < begin)
+      return i;  // An item
+    const Node* node = _get(i);
+    S children[2] = {node->children[0], node->children[1]};
+    if (node->n_descendants > _K) {
+      for (int side = 0; side < 2; side++)
+        children[side] = _renumber_subtree(children[side], begin, nodes, n_buckets, buckets);
+    }
+    size_t p = nodes->size();
+    nodes->resize(p + _s);
+    Node* copy = (Node*)&(*nodes)[p];
+    memcpy(copy, node, _s);
+    if (node->n_descendants > _K) {
+      copy->children[0] = children[0];
+      copy->children[1] = children[1];
+    } else if (node->n_descendants > _leaf_capacity) {
+      // The buckets go in the same order as the leaves
+      _set_bucket_offset(copy, n_buckets + buckets->size());
+      const S* dst = _leaf_items(node, _bucket_data());
+      buckets->insert(buckets->end(), dst, &dst[node->n_descendants]);
+    }
+    return begin + (S)(p / _s);
   }
 
-  void get_nns_by_vector(const T* w, size_t n, int search_k, vector<S>* result, vector<T>* distances) const {
-    _get_all_nns(w, n, search_k, result, distances);
+  void _report_progress(bool finished_tree, ThreadedBuildPolicy& threaded_build_policy) {
+    if (!_build_callback || !_building)
+      return;
+    threaded_build_policy.lock_progress();
+    double now = ThreadedBuildPolicy::now();
+    if (finished_tree)
+      _progress.n_trees++;
+    if (!_cancelled && (finished_tree || now - _progress_reported >= 1.0)) {
+      _progress.n_nodes = threaded_build_policy.n_reserved_blocks() * _node_block_size();
+      _progress.elapsed = now - _progress_start;
+
+      // With q == -1, thread_build stops once there are as many nodes as twice the number of items
+      double done = 0;
+      if (_build_q > 0) {
+        done = (double)_progress.n_trees / _build_q;
+      } else if (_build_q == -1) {
+        double n_nodes_left = 2.0 * _n_items - _n_nodes;
+        done = n_nodes_left > 0 ? std::min(1.0, _progress.n_nodes / n_nodes_left) : 1.0;
+      }
+      _progress.eta = done > 0 ? _progress.elapsed * (1 - done) / done : -1;
+
+      _progress_reported = now;
+      if (!_build_callback(&_progress, _build_callback_arg))
+        _cancelled = true;
+    }
+    threaded_build_policy.unlock_progress();
   }
 
-  S get_n_items() const {
-    return _n_items;
+  size_t _node_block_size() const {
+    return std::max((size_t)16, (size_t)ANNOYLIB_NODE_BLOCK_SIZE / _s);
   }
 
-  S get_n_trees() const {
-    return (S)_roots.size();
+  S _allocate_node(Node** node, ThreadedBuildPolicy& threaded_build_policy) {
+    vector<_NodeBlock>& arena = _arenas[threaded_build_policy.current_thread()];
+    const size_t block_size = _node_block_size();
+    if (arena.empty() || (size_t)arena.back().n_nodes == block_size) {
+      _NodeBlock block = {threaded_build_policy.reserve_block(), 0, NULL, NULL, 0};
+      _new_node_block(&block);
+      arena.push_back(block);
+      _report_progress(false, threaded_build_policy);
+    }
+    _NodeBlock& block = arena.back();
+    *node = (Node*)(block.nodes + block.n_nodes * _s);
+    return _n_nodes + (S)(block.index * block_size) + block.n_nodes++;
   }
 
-  void verbose(bool v) {
-    _verbose = v;
+  void _new_node_block(_NodeBlock* block) const {
+    // With on_disk_build, a block goes right into the part of the file given by its provisional ids, so that
+    // the new trees only take up page cache instead of heap. If that fails, or otherwise, it goes on the heap.
+    const size_t block_bytes = _node_block_size() * _s;
+#if !defined(_MSC_VER) && !defined(__MINGW32__)
+    if (_on_disk) {
+      size_t offset = ((size_t)_n_nodes + block->index * _node_block_size()) * _s;
+      size_t page_offset = offset % (size_t)sysconf(_SC_PAGESIZE);
+      // Writing the last byte grows the file if needed, and unlike ftruncate never shrinks it under another thread
+      char zero = 0;
+      if (pwrite(_fd, &zero, 1, (off_t)(offset + block_bytes - 1)) == 1) {
+        void* mapping = mmap(NULL, block_bytes + page_offset, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, (off_t)(offset - page_offset));
+        if (mapping != MAP_FAILED) {
+          block->mapping = (char*)mapping;
+          block->mapping_size = block_bytes + page_offset;
+          block->nodes = block->mapping + page_offset;
+          // Earlier builds may have left nodes there, e.g. root copies that add_trees overwrites
+          memset(block->nodes, 0, block_bytes);
+          return;
+        }
+      }
+    }
+#endif
+    block->nodes = (char*)calloc(_node_block_size(), _s);
   }
 
-  void get_item(S item, T* v) const {
-    // TODO: handle OOB
-    Node* m = _get(item);
-    memcpy(v, m->v, (_f) * sizeof(T));
+  void _free_node_block(const _NodeBlock& block) const {
+    if (block.mapping)
+      munmap(block.mapping, block.mapping_size);
+    else
+      free(block.nodes);
   }
 
-  void set_seed(R seed) {
-    _seed = seed;
+  S _compacted_id(S i, const vector<S>& offsets) const {
+    if (i < _n_nodes)
+      return i;  // An item, or a node of an earlier build
+    size_t p = (size_t)(i - _n_nodes);
+    return _n_nodes + offsets[p / _node_block_size()] + (S)(p % _node_block_size());
   }
 
-  void thread_build(int q, int thread_idx, ThreadedBuildPolicy& threaded_build_policy) {
-    // Each thread needs its own seed, otherwise each thread would be building the same tree(s)
-    Random _random(_seed + thread_idx);
+  void _compact_nodes(size_t n_roots) {
+    // Copies the blocks after the existing nodes in the order they were reserved, so that with one thread
+    // the provisional ids are the final ones.
+    size_t n_blocks = 0;
+    for (size_t t = 0; t < _arenas.size(); t++)
+      n_blocks += _arenas[t].size();
+    vector<_NodeBlock> blocks(n_blocks);
+    for (size_t t = 0; t < _arenas.size(); t++)
+      for (size_t b = 0; b < _arenas[t].size(); b++)
+        blocks[_arenas[t][b].index] = _arenas[t][b];
+    _arenas.clear();
+
+    vector<S> offsets(n_blocks + 1, 0);
+    bool mapped = false;
+    for (size_t b = 0; b < n_blocks; b++) {
+      offsets[b + 1] = offsets[b] + blocks[b].n_nodes;
+      mapped = mapped || blocks[b].mapping;
+    }
 
-    vector<S> thread_roots;
-    while (1) {
-      if (q == -1) {
-        threaded_build_policy.lock_n_nodes();
-        if (_n_nodes >= 2 * _n_items) {
-          threaded_build_policy.unlock_n_nodes();
-          break;
-        }
-        threaded_build_policy.unlock_n_nodes();
+    // Blocks in the file are already at their provisional ids, which we need to reach through _nodes to move
+    // them down. Moving them in order never overwrites a block that hasn't moved yet.
+    _allocate_size(_n_nodes + (mapped ? (S)(n_blocks * _node_block_size()) : offsets[n_blocks]));
+    for (size_t b = 0; b < n_blocks; b++) {
+      if (blocks[b].mapping) {
+        _free_node_block(blocks[b]);
+        memmove(_get(_n_nodes + offsets[b]), _get(_n_nodes + (S)(b * _node_block_size())), blocks[b].n_nodes * _s);
       } else {
-        if (thread_roots.size() >= (size_t)q) {
-          break;
-        }
+        memcpy(_get(_n_nodes + offsets[b]), blocks[b].nodes, blocks[b].n_nodes * _s);
+        _free_node_block(blocks[b]);
       }
+    }
 
-      if (_verbose) annoylib_showUpdate("pass %zd...\n", thread_roots.size());
-
-      vector<S> indices;
-      threaded_build_policy.lock_shared_nodes();
-      for (S i = 0; i < _n_items; i++) {
-        if (_get(i)->n_descendants >= 1) { // Issue #223
-          indices.push_back(i);
-        }
+    for (S i = _n_nodes; i < _n_nodes + offsets[n_blocks]; i++) {
+      Node* n = _get(i);
+      if (n->n_descendants > _K) {
+        n->children[0] = _compacted_id(n->children[0], offsets);
+        n->children[1] = _compacted_id(n->children[1], offsets);
       }
-      threaded_build_policy.unlock_shared_nodes();
-
-      thread_roots.push_back(_make_tree(indices, true, _random, threaded_build_policy));
     }
-
-    threaded_build_policy.lock_roots();
-    _roots.insert(_roots.end(), thread_roots.begin(), thread_roots.end());
-    threaded_build_policy.unlock_roots();
+    for (size_t i = n_roots; i < _roots.size(); i++)
+      _roots[i] = _compacted_id(_roots[i], offsets);
+    _n_nodes += offsets[n_blocks];
   }
-
-protected:
+  
   void _reallocate_nodes(S n) {
     const double reallocation_factor = 1.3;
     S new_nodes_size = std::max(n, (S) ((_nodes_size + 1) * reallocation_factor));
@@ -1316,14 +3439,6 @@ protected:
     if (_verbose) annoylib_showUpdate("Reallocating to %d nodes: old_address=%p, new_address=%p\n", new_nodes_size, old, _nodes);
   }
 
-  void _allocate_size(S n, ThreadedBuildPolicy& threaded_build_policy) {
-    if (n > _nodes_size) {
-      threaded_build_policy.lock_nodes();
-      _reallocate_nodes(n);
-      threaded_build_policy.unlock_nodes();
-    }
-  }
-
   void _allocate_size(S n) {
     if (n > _nodes_size) {
       _reallocate_nodes(n);
@@ -1334,150 +3449,264 @@ protected:
     return get_node_ptr<S, Node>(_nodes, _s, i);
   }
 
-  double _split_imbalance(const vector<S>& left_indices, const vector<S>& right_indices) {
-    double ls = (float)left_indices.size();
-    double rs = (float)right_indices.size();
+  double _split_imbalance(size_t left_size, size_t right_size) const {
+    double ls = (float)left_size;
+    double rs = (float)right_size;
     float f = ls / (ls + rs + 1e-9);  // Avoid 0/0
     return std::max(f, 1-f);
   }
 
-  S _make_tree(const vector<S>& indices, bool is_root, Random& _random, ThreadedBuildPolicy& threaded_build_policy) {
+  struct _ItemRun {
+    // A copy of the items of a subtree, in the order of their ids. The subtree's indices are positions in it.
+    vector<S> ids;
+    vector<char> nodes;
+  };
+
+  struct _Scratch {
+    // Buffers that _make_tree reuses at every level of a tree, instead of allocating new vectors for each split
+    vector<Node*> nodes;
+    vector<Node*> sample;
+    vector<uint8_t> sides;
+    vector<S> indices;
+    const _ItemRun* run; // The items of the subtree that is being built, if they were copied to memory
+
+    _Scratch() : run(NULL) {}
+  };
+
+  S _make_tree(S* indices, size_t n, bool is_root, Random& _random, _Scratch& scratch, ThreadedBuildPolicy& threaded_build_policy) {
     // The basic rule is that if we have <= _K items, then it's a leaf node, otherwise it's a split node.
     // There's some regrettable complications caused by the problem that root nodes have to be "special":
     // 1. We identify root nodes by the arguable logic that _n_items == n->n_descendants, regardless of how many descendants they actually have
     // 2. Root nodes with only 1 child need to be a "dummy" parent
     // 3. Due to the _n_items "hack", we need to be careful with the cases where _n_items <= _K or _n_items > _K
-    if (indices.size() == 1 && !is_root)
-      return indices[0];
-
-    if (indices.size() <= (size_t)_K && (!is_root || (size_t)_n_items <= (size_t)_K || indices.size() == 1)) {
-      threaded_build_policy.lock_n_nodes();
-      _allocate_size(_n_nodes + 1, threaded_build_policy);
-      S item = _n_nodes++;
-      threaded_build_policy.unlock_n_nodes();
-
-      threaded_build_policy.lock_shared_nodes();
-      Node* m = _get(item);
-      m->n_descendants = is_root ? _n_items : (S)indices.size();
-
-      // Using std::copy instead of a loop seems to resolve issues #3 and #13,
-      // probably because gcc 4.8 goes overboard with optimizations.
-      // Using memcpy instead of std::copy for MSVC compatibility. #235
-      // Only copy when necessary to avoid crash in MSVC 9. #293
-      if (!indices.empty())
-        memcpy(m->children, &indices[0], indices.size() * sizeof(S));
+    if (n == 1 && !is_root)
+      return scratch.run ? scratch.run->ids[indices[0]] : indices[0];
+
+    // After cancel_build, we return right away, and _build_trees drops what we built
+    if (_building && _cancelled)
+      return 0;
+
+    if (_building && _run_memory > 0 && !scratch.run && n > (size_t)_K && n * (_split_s() + sizeof(S)) <= _run_memory)
+      return _make_tree_from_run(indices, n, is_root, _random, scratch, threaded_build_policy);
+
+    if (n <= (size_t)_K && (!is_root || (size_t)_n_items <= (size_t)_K || n <= 1)) {
+      if (scratch.run) {
+        if (scratch.indices.size() < n)
+          scratch.indices.resize(n);
+        for (size_t i = 0; i < n; i++)
+          scratch.indices[i] = scratch.run->ids[indices[i]];
+        indices = &scratch.indices[0];
+      }
+      Node* m;
+      S item = _allocate_node(&m, threaded_build_policy);
+      S n_descendants = is_root ? _n_items : (S)n;
+      if (n_descendants > _leaf_capacity) {
+        threaded_build_policy.lock_buckets();
+        _set_leaf(m, indices, n, n_descendants, &_buckets);
+        threaded_build_policy.unlock_buckets();
+      } else {
+        _set_leaf(m, indices, n, n_descendants, NULL);
+      }
 
-      threaded_build_policy.unlock_shared_nodes();
       return item;
     }
 
-    threaded_build_policy.lock_shared_nodes();
-    vector<Node*> children;
-    for (size_t i = 0; i < indices.size(); i++) {
-      S j = indices[i];
-      Node* n = _get(j);
-      if (n)
-        children.push_back(n);
-    }
-
-    vector<S> children_indices[2];
     Node* m = (Node*)alloca(_s);
-
+    memset(m, 0, _s); // Not all metrics set every field of a split, and we want the same bytes every time
+    scratch.nodes.resize(n);
+    if (scratch.run) {
+      for (size_t i = 0; i < n; i++)
+        scratch.nodes[i] = (Node*)&scratch.run->nodes[(size_t)indices[i] * _split_s()];
+    } else {
+      for (size_t i = 0; i < n; i++)
+        scratch.nodes[i] = _split_item(indices[i]);
+    }
+    if (scratch.sides.size() < n)
+      scratch.sides.resize(n);
+    uint8_t* sides = &scratch.sides[0];
+
+    size_t sizes[2];
+    size_t sample_size = _split_sample_size;
+    if (sample_size == 0 && _building && _run_memory > 0 && !scratch.run)
+      sample_size = ANNOYLIB_OUT_OF_CORE_SAMPLE_SIZE; // Too large to copy, so we don't read all the items more than once
+    const bool sampled = sample_size > 0 && n > sample_size;
     for (int attempt = 0; attempt < 3; attempt++) {
-      children_indices[0].clear();
-      children_indices[1].clear();
-      D::create_split(children, _f, _s, _random, m);
-
-      for (size_t i = 0; i < indices.size(); i++) {
-        S j = indices[i];
-        Node* n = _get(j);
-        if (n) {
-          bool side = D::side(m, n, _f, _random);
-          children_indices[side].push_back(j);
-        } else {
-          annoylib_showUpdate("No node for index %d?\n", j);
-        }
+      sizes[0] = sizes[1] = 0;
+      if (sampled) {
+        scratch.sample.resize(sample_size);
+        for (size_t i = 0; i < sample_size; i++)
+          scratch.sample[i] = scratch.nodes[_random.index(n)];
+        D::create_split(scratch.sample, _split_f(), _s, _random, m);
+        for (size_t i = 0; i < sample_size; i++)
+          sizes[D::side(m, scratch.sample[i], _split_f(), _random)]++;
+      } else {
+        D::create_split(scratch.nodes, _split_f(), _s, _random, m);
+        _compute_sides(m, n, scratch, _random, threaded_build_policy);
+        for (size_t i = 0; i < n; i++)
+          sizes[sides[i]]++;
       }
-
-      if (_split_imbalance(children_indices[0], children_indices[1]) < 0.95)
+      if (_split_imbalance(sizes[0], sizes[1]) < 0.95)
         break;
     }
-    threaded_build_policy.unlock_shared_nodes();
+
+    if (sampled) {
+      // The sample told us which split to use, now assign all the items
+      _compute_sides(m, n, scratch, _random, threaded_build_policy);
+      sizes[0] = sizes[1] = 0;
+      for (size_t i = 0; i < n; i++)
+        sizes[sides[i]]++;
+    }
 
     // If we didn't find a hyperplane, just randomize sides as a last option
-    while (_split_imbalance(children_indices[0], children_indices[1]) > 0.99) {
+    while (_split_imbalance(sizes[0], sizes[1]) > 0.99) {
       if (_verbose)
         annoylib_showUpdate("\tNo hyperplane found (left has %zu children, right has %zu children)\n",
-          children_indices[0].size(), children_indices[1].size());
-
-      children_indices[0].clear();
-      children_indices[1].clear();
+          sizes[0], sizes[1]);
 
       // Set the vector to 0.0
-      for (int z = 0; z < _f; z++)
+      for (int z = 0; z < _split_f(); z++)
         m->v[z] = 0;
 
-      for (size_t i = 0; i < indices.size(); i++) {
-        S j = indices[i];
+      sizes[0] = sizes[1] = 0;
+      for (size_t i = 0; i < n; i++) {
         // Just randomize...
-        children_indices[_random.flip()].push_back(j);
+        sides[i] = _random.flip();
+        sizes[sides[i]]++;
       }
     }
 
-    int flip = (children_indices[0].size() > children_indices[1].size());
-
-    m->n_descendants = is_root ? _n_items : (S)indices.size();
-    for (int side = 0; side < 2; side++) {
-      // run _make_tree for the smallest child first (for cache locality)
-      m->children[side^flip] = _make_tree(children_indices[side^flip], false, _random, threaded_build_policy);
+    // Both children are built on their part of the same array
+    _partition(indices, n, scratch);
+    S* children_indices[2] = {indices, indices + sizes[0]};
+
+    int flip = (sizes[0] > sizes[1]);
+
+    m->n_descendants = is_root ? _n_items : (S)n;
+    if ((ThreadedBuildPolicy::parallel || _deterministic) && sizes[flip^1] >= ANNOYLIB_PARALLEL_SUBTREE_SIZE) {
+      // Build the larger child as a task that idle threads can steal, with its own random seed.
+      // The smaller child runs right away in this thread, so it can keep using our scratch buffers.
+      _SubtreeTask tasks[2];
+      for (int side = 0; side < 2; side++) {
+        _SubtreeTask task = {this, children_indices[side^flip], sizes[side^flip], _random_seed(_random),
+                             &threaded_build_policy, side == 0 ? &scratch : NULL, scratch.run, 0};
+        tasks[side] = task;
+      }
+      threaded_build_policy.fork_join(tasks[0], tasks[1]);
+      for (int side = 0; side < 2; side++)
+        m->children[side^flip] = tasks[side].result;
+    } else {
+      for (int side = 0; side < 2; side++) {
+        // run _make_tree for the smallest child first (for cache locality)
+        m->children[side^flip] = _make_tree(children_indices[side^flip], sizes[side^flip], false, _random, scratch, threaded_build_policy);
+      }
     }
 
-    threaded_build_policy.lock_n_nodes();
-    _allocate_size(_n_nodes + 1, threaded_build_policy);
-    S item = _n_nodes++;
-    threaded_build_policy.unlock_n_nodes();
+    Node* node;
+    S item = _allocate_node(&node, threaded_build_policy);
+    memcpy(node, m, _s);
 
-    threaded_build_policy.lock_shared_nodes();
-    memcpy(_get(item), m, _s);
-    threaded_build_policy.unlock_shared_nodes();
+    return item;
+  }
 
+  S _make_tree_from_run(S* indices, size_t n, bool is_root, Random& _random, _Scratch& scratch, ThreadedBuildPolicy& threaded_build_policy) {
+    // The indices of a tree start out sorted, and _partition keeps them sorted, so this reads the items in the
+    // order they are stored in. The subtree then only reads the copy, and finds the items by their position in it.
+    _ItemRun run;
+    run.ids.assign(indices, indices + n);
+    std::sort(run.ids.begin(), run.ids.end());
+    size_t s = _split_s();
+    run.nodes.resize(n * s);
+    for (size_t i = 0; i < n; i++)
+      memcpy(&run.nodes[i * s], _split_item(run.ids[i]), s);
+    for (size_t i = 0; i < n; i++)
+      indices[i] = (S)(std::lower_bound(run.ids.begin(), run.ids.end(), indices[i]) - run.ids.begin());
+
+    scratch.run = &run;
+    S item = _make_tree(indices, n, is_root, _random, scratch, threaded_build_policy);
+    scratch.run = NULL;
     return item;
   }
 
+  void _partition(S* indices, size_t n, _Scratch& scratch) {
+    // Moves the items on side 0 to the front, keeping their order, so that the tree only depends on the split
+    if (scratch.indices.size() < n)
+      scratch.indices.resize(n);
+    size_t left = 0, right = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (scratch.sides[i])
+        scratch.indices[right++] = indices[i];
+      else
+        indices[left++] = indices[i];
+    }
+    if (right > 0)
+      memcpy(indices + left, &scratch.indices[0], right * sizeof(S));
+  }
+
+  struct _SubtreeTask {
+    AnnoyIndex* annoy;
+    S* indices;
+    size_t n;
+    R seed;
+    ThreadedBuildPolicy* threaded_build_policy;
+    _Scratch* scratch; // NULL for tasks that may run in other threads
+    const _ItemRun* run;
+    S result;
+
+    void operator()() {
+      Random random(seed);
+      if (scratch) {
+        result = annoy->_make_tree(indices, n, false, random, *scratch, *threaded_build_policy);
+      } else {
+        _Scratch own_scratch;
+        own_scratch.run = run;
+        result = annoy->_make_tree(indices, n, false, random, own_scratch, *threaded_build_policy);
+      }
+    }
+  };
+
+  struct _SideTask {
+    const AnnoyIndex* annoy;
+    const Node* split;
+    Node* const* nodes;
+    uint8_t* sides;
+    R seed;
+
+    void operator()(size_t begin, size_t end) const {
+      // Seeded by the position of the range, so the result doesn't depend on which thread runs it
+      Random random(seed + begin);
+      for (size_t i = begin; i < end; i++)
+        sides[i] = D::side(split, nodes[i], annoy->_split_f(), random);
+    }
+  };
+
+  static R _random_seed(Random& random) {
+    R seed = random.kiss();
+    return seed ? seed : Random::default_seed;  // Seeds must be != 0
+  }
+
+  void _compute_sides(const Node* m, size_t n, _Scratch& scratch, Random& _random, ThreadedBuildPolicy& threaded_build_policy) {
+    // Deterministic builds split the same way with any number of threads, and with either policy
+    if ((ThreadedBuildPolicy::parallel || _deterministic) && n >= ANNOYLIB_PARALLEL_SPLIT_SIZE) {
+      _SideTask task = {this, m, &scratch.nodes[0], &scratch.sides[0], _random_seed(_random)};
+      threaded_build_policy.parallel_for(0, n, ANNOYLIB_PARALLEL_SPLIT_GRAIN, task);
+    } else {
+      for (size_t i = 0; i < n; i++)
+        scratch.sides[i] = D::side(m, scratch.nodes[i], _split_f(), _random);
+    }
+  }
+
   void _get_all_nns(const T* v, size_t n, int search_k, vector<S>* result, vector<T>* distances) const {
     Node* v_node = (Node *)alloca(_s);
     D::template zero_value<Node>(v_node);
     memcpy(v_node->v, v, sizeof(T) * _f);
     D::init_node(v_node, _f);
 
-    std::priority_queue<pair<T, S> > q;
-
     if (search_k == -1) {
       search_k = n * _roots.size();
     }
 
-    for (size_t i = 0; i < _roots.size(); i++) {
-      q.push(make_pair(Distance::template pq_initial_value<T>(), _roots[i]));
-    }
-
     std::vector<S> nns;
-    while (nns.size() < (size_t)search_k && !q.empty()) {
-      const pair<T, S>& top = q.top();
-      T d = top.first;
-      S i = top.second;
-      Node* nd = _get(i);
-      q.pop();
-      if (nd->n_descendants == 1 && i < _n_items) {
-        nns.push_back(i);
-      } else if (nd->n_descendants <= _K) {
-        const S* dst = nd->children;
-        nns.insert(nns.end(), dst, &dst[nd->n_descendants]);
-      } else {
-        T margin = D::margin(nd, v, _f);
-        q.push(make_pair(D::pq_distance(d, margin, 1), static_cast<S>(nd->children[1])));
-        q.push(make_pair(D::pq_distance(d, margin, 0), static_cast<S>(nd->children[0])));
-      }
-    }
+    _get_candidates(v, search_k, &nns);
 
     // Get distances for all items
     // To avoid calculating distance multiple times for any items, sort by id
@@ -1502,58 +3731,259 @@ protected:
       result->push_back(nns_dist[i].second);
     }
   }
+
+  void _get_candidates(const T* v, int search_k, vector<S>* result) const {
+    // Collects the items of the leaves closest to v until there are search_k of them, with duplicates
+    int f = _f;
+    if (_projected_f) {
+      T* projected = (T*)alloca(sizeof(T) * _projected_f);
+      _project(v, projected);
+      v = projected;
+      f = _projected_f;
+    }
+
+    std::priority_queue<pair<T, S> > q;
+    for (size_t i = 0; i < _roots.size(); i++) {
+      q.push(make_pair(Distance::template pq_initial_value<T>(), _roots[i]));
+    }
+
+    vector<S>& nns = *result;
+    while (nns.size() < (size_t)search_k && !q.empty()) {
+      const pair<T, S>& top = q.top();
+      T d = top.first;
+      S i = top.second;
+      Node* nd = _get(i);
+      q.pop();
+      if (nd->n_descendants == 1 && i < _n_items) {
+        nns.push_back(i);
+      } else if (nd->n_descendants <= _K) {
+        const S* dst = _leaf_items(nd, _bucket_data());
+        nns.insert(nns.end(), dst, &dst[nd->n_descendants]);
+      } else {
+        T margin = D::margin(nd, v, f);
+        q.push(make_pair(D::pq_distance(d, margin, 1), static_cast<S>(nd->children[1])));
+        q.push(make_pair(D::pq_distance(d, margin, 0), static_cast<S>(nd->children[0])));
+      }
+    }
+  }
 };
 
 class AnnoyIndexSingleThreadedBuildPolicy {
+private:
+  size_t n_blocks;
+
 public:
+  static const bool parallel = false;
+
+  AnnoyIndexSingleThreadedBuildPolicy() : n_blocks(0) {}
+
+  static int resolve_n_threads(int) {
+    return 1;
+  }
+
   template<typename S, typename T, typename D, typename Random>
   static void build(AnnoyIndex<S, T, D, Random, AnnoyIndexSingleThreadedBuildPolicy>* annoy, int q, int n_threads) {
     AnnoyIndexSingleThreadedBuildPolicy threaded_build_policy;
     annoy->thread_build(q, 0, threaded_build_policy);
   }
 
-  void lock_n_nodes() {}
-  void unlock_n_nodes() {}
+  template<typename Task>
+  void fork_join(Task& a, Task& b) {
+    a();
+    b();
+  }
+
+  template<typename Task>
+  void parallel_for(size_t begin, size_t end, size_t grain, Task& task) {
+    // The same ranges as the multithreaded policy, so that deterministic builds are the same with both
+    for (size_t i = begin; i < end; i += grain)
+      task(i, std::min(end, i + grain));
+  }
+
+  template<typename Task>
+  static void parallel_ranges(size_t n, size_t, int, Task& task) {
+    task(0, n);
+  }
 
-  void lock_nodes() {}
-  void unlock_nodes() {}
+  int current_thread() const {
+    return 0;
+  }
 
-  void lock_shared_nodes() {}
-  void unlock_shared_nodes() {}
+  size_t reserve_block() {
+    return n_blocks++;
+  }
+  size_t n_reserved_blocks() const {
+    return n_blocks;
+  }
 
   void lock_roots() {}
   void unlock_roots() {}
+  void lock_progress() {}
+  void unlock_progress() {}
+  void lock_buckets() {}
+  void unlock_buckets() {}
+
+  typedef volatile bool StopFlag;
+
+  static double now() {
+    // Processor time, which is close to the time passed, since the build keeps one core busy
+    return (double)clock() / CLOCKS_PER_SEC;
+  }
+
+  class Prefaulter {
+    // Without threads we can't prefault in the background, so this prefaults in the calling thread.
+  public:
+    void start(const vector<pair<const void*, size_t> >& ranges, int) {
+      for (size_t i = 0; i < ranges.size(); i++)
+        prefault_pages(ranges[i].first, ranges[i].second);
+    }
+    double progress() const { return 1.0; }
+    void wait() {}
+    void stop() {}
+  };
 };
 
 #ifdef ANNOYLIB_MULTITHREADED_BUILD
 class AnnoyIndexMultiThreadedBuildPolicy {
 private:
-  std::shared_timed_mutex nodes_mutex;
-  std::mutex n_nodes_mutex;
   std::mutex roots_mutex;
+  std::mutex progress_mutex;
+  std::mutex buckets_mutex;
+  std::atomic<size_t> n_blocks;
+
+  // Every thread builds its share of the trees, and forks off subtrees and partition loops as tasks.
+  // Tasks go to the back of the forking thread's queue. Threads take tasks from the back of their own
+  // queue, and steal from the front of other threads' queues when they run out of work, so that threads
+  // with fewer trees help the others.
+  struct Task {
+    std::function<void()> run;
+    std::atomic<bool> done;
+  };
+  struct TaskQueue {
+    std::mutex mutex;
+    std::deque<Task*> tasks;
+  };
+  vector<std::unique_ptr<TaskQueue> > queues;
+  std::atomic<int> n_running_threads;
+  // Threads that find nothing to steal sleep on idle_cv until a task is pushed or done, or a thread
+  // runs out of trees. n_idle lets the others skip the notification while nobody sleeps.
+  std::mutex idle_mutex;
+  std::condition_variable idle_cv;
+  std::atomic<int> n_idle;
+
+  static int& thread_idx() {
+    static thread_local int idx = -1;
+    return idx;
+  }
+
+  void push(int idx, Task* task) {
+    {
+      std::lock_guard<std::mutex> lock(queues[idx]->mutex);
+      queues[idx]->tasks.push_back(task);
+    }
+    wake_idle();
+  }
+
+  void wake_idle() {
+    if (n_idle > 0) {
+      std::lock_guard<std::mutex> lock(idle_mutex);
+      idle_cv.notify_all();
+    }
+  }
+
+  bool has_tasks() {
+    for (size_t i = 0; i < queues.size(); i++) {
+      std::lock_guard<std::mutex> lock(queues[i]->mutex);
+      if (!queues[i]->tasks.empty())
+        return true;
+    }
+    return false;
+  }
+
+  template<typename Ready>
+  void run_until(int idx, const Ready& ready) {
+    // Runs other tasks until ready(), and sleeps while there are none. Whatever makes ready() true or
+    // pushes a task calls wake_idle() afterwards, which either finds n_idle set or happens before we check.
+    while (!ready()) {
+      if (run_one(idx))
+        continue;
+      std::unique_lock<std::mutex> lock(idle_mutex);
+      n_idle++;
+      if (!ready() && !has_tasks())
+        idle_cv.wait(lock);
+      n_idle--;
+    }
+  }
+
+  bool pop(int idx, Task* task) {
+    // Takes task back from our own queue, unless it has been stolen
+    std::lock_guard<std::mutex> lock(queues[idx]->mutex);
+    if (queues[idx]->tasks.empty() || queues[idx]->tasks.back() != task)
+      return false;
+    queues[idx]->tasks.pop_back();
+    return true;
+  }
+
+  bool run_one(int idx) {
+    Task* task = NULL;
+    for (size_t i = 0; i < queues.size() && !task; i++) {
+      TaskQueue& queue = *queues[(idx + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty())
+        continue;
+      if (i == 0) {
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+      } else {
+        task = queue.tasks.front();
+        queue.tasks.pop_front();
+      }
+    }
+    if (!task)
+      return false;
+    task->run();
+    task->done = true;
+    wake_idle();
+    return true;
+  }
 
 public:
-  template<typename S, typename T, typename D, typename Random>
-  static void build(AnnoyIndex<S, T, D, Random, AnnoyIndexMultiThreadedBuildPolicy>* annoy, int q, int n_threads) {
-    AnnoyIndexMultiThreadedBuildPolicy threaded_build_policy;
+  static const bool parallel = true;
+
+  AnnoyIndexMultiThreadedBuildPolicy() : n_blocks(0), n_idle(0) {}
+
+  static int resolve_n_threads(int n_threads) {
     if (n_threads == -1) {
       // If the hardware_concurrency() value is not well defined or not computable, it returns 0.
       // We guard against this by using at least 1 thread.
       n_threads = std::max(1, (int)std::thread::hardware_concurrency());
     }
+    return n_threads;
+  }
+
+  template<typename S, typename T, typename D, typename Random>
+  static void build(AnnoyIndex<S, T, D, Random, AnnoyIndexMultiThreadedBuildPolicy>* annoy, int q, int n_threads) {
+    AnnoyIndexMultiThreadedBuildPolicy threaded_build_policy;
+    n_threads = resolve_n_threads(n_threads);
 
     vector<std::thread> threads(n_threads);
+    for (int thread_idx = 0; thread_idx < n_threads; thread_idx++)
+      threaded_build_policy.queues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+    threaded_build_policy.n_running_threads = n_threads;
 
     for (int thread_idx = 0; thread_idx < n_threads; thread_idx++) {
       int trees_per_thread = q == -1 ? -1 : (int)floor((q + thread_idx) / n_threads);
 
-      threads[thread_idx] = std::thread(
-        &AnnoyIndex<S, T, D, Random, AnnoyIndexMultiThreadedBuildPolicy>::thread_build,
-        annoy,
-        trees_per_thread,
-        thread_idx,
-        std::ref(threaded_build_policy)
-      );
+      threads[thread_idx] = std::thread([annoy, trees_per_thread, thread_idx, &threaded_build_policy]() {
+        AnnoyIndexMultiThreadedBuildPolicy::thread_idx() = thread_idx;
+        annoy->thread_build(trees_per_thread, thread_idx, threaded_build_policy);
+        threaded_build_policy.n_running_threads--;
+        threaded_build_policy.wake_idle();
+        // Help the other threads until all trees are done
+        auto all_done = [&threaded_build_policy]() { return threaded_build_policy.n_running_threads == 0; };
+        threaded_build_policy.run_until(thread_idx, all_done);
+        AnnoyIndexMultiThreadedBuildPolicy::thread_idx() = -1;
+      });
     }
 
     for (auto& thread : threads) {
@@ -1561,25 +3991,68 @@ public:
     }
   }
 
-  void lock_n_nodes() {
-    n_nodes_mutex.lock();
+  template<typename TaskA, typename TaskB>
+  void fork_join(TaskA& a, TaskB& b) {
+    // Runs a, while b can be stolen by other threads. Make sure to not hold any locks when calling this,
+    // since waiting for b means running other tasks, which may need them.
+    int idx = thread_idx();
+    if (idx == -1) {
+      a();
+      b();
+      return;
+    }
+    Task task;
+    task.run = [&b]() { b(); };
+    task.done = false;
+    push(idx, &task);
+    a();
+    if (pop(idx, &task)) {
+      b();
+      return;
+    }
+    run_until(idx, [&task]() { return (bool)task.done; });
   }
-  void unlock_n_nodes() {
-    n_nodes_mutex.unlock();
+
+  template<typename F>
+  void parallel_for(size_t begin, size_t end, size_t grain, F& f) {
+    if (end - begin <= grain) {
+      f(begin, end);
+      return;
+    }
+    // Split in multiples of grain, so the ranges only depend on begin, end and grain
+    size_t mid = begin + (end - begin) / grain / 2 * grain;
+    if (mid == begin)
+      mid += grain;
+    auto left = [&]() { parallel_for(begin, mid, grain, f); };
+    auto right = [&]() { parallel_for(mid, end, grain, f); };
+    fork_join(left, right);
   }
 
-  void lock_nodes() {
-    nodes_mutex.lock();
+  template<typename F>
+  static void parallel_ranges(size_t n, size_t grain, int n_threads, F& f) {
+    // Outside of builds: splits [0, n) into one range per thread, with at least grain elements each
+    n_threads = (int)std::min((size_t)resolve_n_threads(n_threads), std::max((size_t)1, n / grain));
+    vector<std::thread> threads;
+    for (int thread_idx = 1; thread_idx < n_threads; thread_idx++) {
+      size_t begin = n * thread_idx / n_threads, end = n * (thread_idx + 1) / n_threads;
+      threads.push_back(std::thread([&f, begin, end]() { f(begin, end); }));
+    }
+    f(0, n / n_threads);
+    for (auto& thread : threads)
+      thread.join();
   }
-  void unlock_nodes() {
-    nodes_mutex.unlock();
+
+  int current_thread() const {
+    // Outside of build(), e.g. when inserting items, the calling thread counts as the first one
+    int idx = thread_idx();
+    return idx == -1 ? 0 : idx;
   }
 
-  void lock_shared_nodes() {
-    nodes_mutex.lock_shared();
+  size_t reserve_block() {
+    return n_blocks++;
   }
-  void unlock_shared_nodes() {
-    nodes_mutex.unlock_shared();
+  size_t n_reserved_blocks() const {
+    return n_blocks;
   }
 
   void lock_roots() {
@@ -1588,6 +4061,118 @@ public:
   void unlock_roots() {
     roots_mutex.unlock();
   }
+  void lock_progress() {
+    progress_mutex.lock();
+  }
+  void unlock_progress() {
+    progress_mutex.unlock();
+  }
+  void lock_buckets() {
+    buckets_mutex.lock();
+  }
+  void unlock_buckets() {
+    buckets_mutex.unlock();
+  }
+
+  class StopFlag {
+    // An atomic flag, which unlike std::atomic<bool> can be copied along with the index
+  private:
+    std::atomic<bool> flag;
+
+  public:
+    StopFlag() : flag(false) {}
+    StopFlag(const StopFlag& other) : flag(other.flag.load()) {}
+    StopFlag& operator=(bool value) {
+      flag = value;
+      return *this;
+    }
+    operator bool() const {
+      return flag;
+    }
+  };
+
+  static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  class Prefaulter {
+    // Splits the ranges into chunks that a pool of background threads fault in, in the order given.
+    // start, wait and stop can be called from different threads (Python releases the GIL in wait_prefault),
+    // so the pool and the chunks only change with threads_mutex held, and threads are joined under it.
+  private:
+    static const size_t chunk_size = 1 << 22;
+    vector<pair<const void*, size_t> > chunks;
+    vector<std::thread> threads;
+    std::mutex threads_mutex;
+    std::atomic<size_t> n_chunks;
+    std::atomic<size_t> next_chunk;
+    std::atomic<size_t> done_chunks;
+    std::atomic<bool> stopping;
+
+    void run() {
+      while (!stopping) {
+        size_t i = next_chunk++;
+        if (i >= chunks.size())
+          break;
+        prefault_pages(chunks[i].first, chunks[i].second);
+        done_chunks++;
+      }
+    }
+
+    void join_threads() {
+      for (auto& thread : threads)
+        thread.join();
+      threads.clear();
+    }
+
+  public:
+    Prefaulter() : n_chunks(0), next_chunk(0), done_chunks(0), stopping(false) {}
+    // Keeps AnnoyIndex copyable (e.g. for `AnnoyIndex<...> t = AnnoyIndex<...>(f)`), and the copy isn't prefaulting
+    Prefaulter(const Prefaulter&) : n_chunks(0), next_chunk(0), done_chunks(0), stopping(false) {}
+    ~Prefaulter() {
+      stop();
+    }
+
+    void start(const vector<pair<const void*, size_t> >& ranges, int n_threads) {
+      // Setting stopping before taking the mutex cuts short a wait() that holds it
+      stopping = true;
+      std::lock_guard<std::mutex> lock(threads_mutex);
+      stopping = true;
+      join_threads();
+      chunks.clear();
+      for (size_t i = 0; i < ranges.size(); i++) {
+        const char* data = (const char*)ranges[i].first;
+        for (size_t offset = 0; offset < ranges[i].second; offset += chunk_size)
+          chunks.push_back(make_pair(data + offset, std::min((size_t)chunk_size, ranges[i].second - offset)));
+      }
+      next_chunk = 0;
+      done_chunks = 0;
+      n_chunks = chunks.size();
+      stopping = false;
+      n_threads = resolve_n_threads(n_threads);
+      for (int thread_idx = 0; thread_idx < n_threads; thread_idx++)
+        threads.push_back(std::thread(&Prefaulter::run, this));
+    }
+
+    double progress() const {
+      // Doesn't take the mutex, which wait() holds until the prefaulting is done
+      size_t n = n_chunks;
+      return n == 0 ? 1.0 : std::min(1.0, (double)done_chunks / n);
+    }
+
+    void wait() {
+      std::lock_guard<std::mutex> lock(threads_mutex);
+      join_threads();
+    }
+
+    void stop() {
+      stopping = true;
+      std::lock_guard<std::mutex> lock(threads_mutex);
+      // Again, in case a start() got the mutex first and restarted the pool
+      stopping = true;
+      join_threads();
+    }
+  };
 };
 #endif
 
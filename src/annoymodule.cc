@@ -85,17 +85,79 @@ private:
     }
   };
 public:
-  HammingWrapper(int f) : _f_external(f), _f_internal((f + 63) / 64), _index((f + 63) / 64) {};
+  HammingWrapper(int f, int32_t max_leaf_size=0) : _f_external(f), _f_internal((f + 63) / 64), _index((f + 63) / 64, max_leaf_size) {};
   bool add_item(int32_t item, const float* w, char**error) {
     vector<uint64_t> w_internal(_f_internal, 0);
     _pack(w, &w_internal[0]);
     return _index.add_item(item, &w_internal[0], error);
   };
+  bool add_items(const int32_t* items, const float* w, size_t n, int n_threads, char** error) {
+    vector<uint64_t> w_internal(n * _f_internal, 0);
+    for (size_t i = 0; i < n; i++)
+      _pack(w + i * _f_external, &w_internal[i * _f_internal]);
+    return _index.add_items(items, n ? &w_internal[0] : NULL, n, n_threads, error);
+  };
+  bool add_items_from_file(const char* filename, const char* format, int n_threads, char** error) {
+    // Packs the mmapped rows in batches, so that files larger than memory can be added with on_disk_build
+    AnnoyVectorFile file;
+    if (!file.open(filename, format, _f_external, error))
+      return false;
+    size_t n = file.get_n_rows();
+    if (n > (size_t)(numeric_limits<int32_t>::max() - _index.get_n_items())) {
+      set_error_from_string(error, "Vector file has too many vectors");
+      return false;
+    }
+    const size_t batch_size = 1 << 16;
+    vector<uint64_t> w_internal(std::min(n, batch_size) * _f_internal, 0);
+    // At least one batch, which is empty for empty files, so that loaded indexes fail like for the other metrics
+    for (size_t begin = 0; begin == 0 || begin < n; begin += batch_size) {
+      size_t m = std::min(batch_size, n - begin);
+      for (size_t i = 0; i < m; i++)
+        _pack(file.get_row(begin + i), &w_internal[i * _f_internal]);
+      if (!_index.add_items(NULL, m ? &w_internal[0] : NULL, m, n_threads, error))
+        return false;
+    }
+    return true;
+  };
   bool build(int q, int n_threads, char** error) { return _index.build(q, n_threads, error); };
+  bool build_with_memory_budget(size_t memory_budget, int n_threads, char** error) { return _index.build_with_memory_budget(memory_budget, n_threads, error); };
+  bool add_trees(int q, int n_threads, char** error) { return _index.add_trees(q, n_threads, error); };
+  bool insert_item(int32_t item, const float* w, char** error) {
+    vector<uint64_t> w_internal(_f_internal, 0);
+    _pack(w, &w_internal[0]);
+    return _index.insert_item(item, &w_internal[0], error);
+  };
+  // These take and return the packed vectors as they are stored, see convert_packed_vectors
+  bool add_item_packed(int32_t item, const uint64_t* w, char** error) { return _index.add_item(item, w, error); };
+  bool insert_item_packed(int32_t item, const uint64_t* w, char** error) { return _index.insert_item(item, w, error); };
+  void get_item_packed(int32_t item, uint64_t* v) const { _index.get_item(item, v); };
+  bool mark_deleted(int32_t item, char** error) { return _index.mark_deleted(item, error); };
+  bool compact(char** error) { return _index.compact(error); };
+  bool merge(const AnnoyIndexInterface<int32_t, float>* other_index, char** error) {
+    const HammingWrapper* other = dynamic_cast<const HammingWrapper*>(other_index);
+    if (!other || other->_f_external != _f_external) {
+      set_error_from_string(error, "You can only merge indexes with the same metric and number of dimensions");
+      return false;
+    }
+    return _index.merge(&other->_index, error);
+  };
+  bool merge_trees(const AnnoyIndexInterface<int32_t, float>* other_index, char** error) {
+    const HammingWrapper* other = dynamic_cast<const HammingWrapper*>(other_index);
+    if (!other || other->_f_external != _f_external) {
+      set_error_from_string(error, "You can only merge indexes with the same metric and number of dimensions");
+      return false;
+    }
+    return _index.merge_trees(&other->_index, error);
+  };
   bool unbuild(char** error) { return _index.unbuild(error); };
   bool save(const char* filename, bool prefault, char** error) { return _index.save(filename, prefault, error); };
+  bool save(const char* filename, bool prefault, bool reload, bool atomic, char** error) { return _index.save(filename, prefault, reload, atomic, error); };
+  bool save_to_fd(int fd, char** error) { return _index.save_to_fd(fd, error); };
   void unload() { _index.unload(); };
   bool load(const char* filename, bool prefault, char** error) { return _index.load(filename, prefault, error); };
+  void prefault_async(int n_threads) { _index.prefault_async(n_threads); };
+  double get_prefault_progress() const { return _index.get_prefault_progress(); };
+  void wait_prefault() { _index.wait_prefault(); };
   float get_distance(int32_t i, int32_t j) const { return _index.get_distance(i, j); };
   void get_nns_by_item(int32_t item, size_t n, int search_k, vector<int32_t>* result, vector<float>* distances) const {
     if (distances) {
@@ -109,24 +171,65 @@ public:
   void get_nns_by_vector(const float* w, size_t n, int search_k, vector<int32_t>* result, vector<float>* distances) const {
     vector<uint64_t> w_internal(_f_internal, 0);
     _pack(w, &w_internal[0]);
+    get_nns_by_packed_vector(&w_internal[0], n, search_k, result, distances);
+  };
+  void get_nns_by_packed_vector(const uint64_t* w, size_t n, int search_k, vector<int32_t>* result, vector<float>* distances) const {
     if (distances) {
       vector<uint64_t> distances_internal;
-      _index.get_nns_by_vector(&w_internal[0], n, search_k, result, &distances_internal);
+      _index.get_nns_by_vector(w, n, search_k, result, &distances_internal);
       distances->insert(distances->begin(), distances_internal.begin(), distances_internal.end());
     } else {
-      _index.get_nns_by_vector(&w_internal[0], n, search_k, result, NULL);
+      _index.get_nns_by_vector(w, n, search_k, result, NULL);
+    }
+  };
+  void get_nns_by_vectors(const float* w, size_t n_queries, size_t n, int search_k, int32_t* result, float* distances, int n_threads) const {
+    if (!n_queries || !n)
+      return;
+    vector<uint64_t> w_internal(n_queries * _f_internal, 0);
+    for (size_t q = 0; q < n_queries; q++)
+      _pack(&w[q * _f_external], &w_internal[q * _f_internal]);
+    get_nns_by_packed_vectors(&w_internal[0], n_queries, n, search_k, result, distances, n_threads);
+  };
+  void get_nns_by_packed_vectors(const uint64_t* w, size_t n_queries, size_t n, int search_k, int32_t* result, float* distances, int n_threads) const {
+    if (!n_queries || !n)
+      return;
+    if (distances) {
+      vector<uint64_t> distances_internal(n_queries * n);
+      _index.get_nns_by_vectors(w, n_queries, n, search_k, result, &distances_internal[0], n_threads);
+      for (size_t i = 0; i < n_queries * n; i++)
+        distances[i] = result[i] == -1 ? numeric_limits<float>::quiet_NaN() : distances_internal[i];
+    } else {
+      _index.get_nns_by_vectors(w, n_queries, n, search_k, result, NULL, n_threads);
     }
   };
   int32_t get_n_items() const { return _index.get_n_items(); };
   int32_t get_n_trees() const { return _index.get_n_trees(); };
+  int32_t get_max_leaf_size() const { return _index.get_max_leaf_size(); };
+  void get_memory_usage(AnnoyMemoryUsage* usage) const { _index.get_memory_usage(usage); };
+  bool get_tree_stats(int32_t tree, AnnoyTreeStats* stats, char** error) const { return _index.get_tree_stats(tree, stats, error); };
+  void get_candidate_stats(size_t n_queries, size_t n, int search_k, AnnoyCandidateStats* stats) const {
+    _index.get_candidate_stats(n_queries, n, search_k, stats);
+  };
   void verbose(bool v) { _index.verbose(v); };
   void get_item(int32_t item, float* v) const {
     vector<uint64_t> v_internal(_f_internal, 0);
     _index.get_item(item, &v_internal[0]);
     _unpack(&v_internal[0], v);
   };
+  const float* get_item_vectors(size_t* stride) const {
+    // The items are packed into bits, so there are no float vectors to point to
+    *stride = 0;
+    return NULL;
+  };
   void set_seed(uint64_t q) { _index.set_seed(q); };
+  bool set_split_sample_size(size_t n, char** error) { return _index.set_split_sample_size(n, error); };
   bool on_disk_build(const char* filename, char** error) { return _index.on_disk_build(filename, error); };
+  void set_out_of_core_memory(size_t memory) { _index.set_out_of_core_memory(memory); };
+  bool set_projection(int n_components, char** error) { return _index.set_projection(n_components, error); };
+  int get_projection(float* components) const { return 0; }; // The packed vectors can't be projected
+  void set_deterministic_build(bool deterministic) { _index.set_deterministic_build(deterministic); };
+  void set_build_callback(AnnoyBuildCallback callback, void* arg) { _index.set_build_callback(callback, arg); };
+  void cancel_build() { _index.cancel_build(); };
 };
 
 // annoy python object
@@ -134,9 +237,30 @@ typedef struct {
   PyObject_HEAD
   int f;
   AnnoyIndexInterface<int32_t, float>* ptr;
+  PyObject* build_callback;
+  // The buffers of get_item_vectors, which point into the index, so it can't change while there are any
+  Py_ssize_t n_exports;
+  // Calls that change or write out the index without holding the GIL, during which no buffers can be created
+  Py_ssize_t n_changes;
+  Py_ssize_t export_shape[2];
+  Py_ssize_t export_strides[2];
 } py_annoy;
 
 
+static bool
+check_can_change(py_annoy *self) {
+  if (self->n_exports > 0) {
+    PyErr_SetString(PyExc_BufferError, "The index can't be changed while views of its item vectors exist");
+    return false;
+  }
+  if (self->n_changes > 0) {
+    PyErr_SetString(PyExc_RuntimeError, "The index can't be changed while another thread is changing it");
+    return false;
+  }
+  return true;
+}
+
+
 static PyObject *
 py_an_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
   py_annoy *self = (py_annoy *)type->tp_alloc(type, 0);
@@ -144,25 +268,30 @@ py_an_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
     return NULL;
   }
   const char *metric = NULL;
+  int max_leaf_size = 0;
 
-  static char const * kwlist[] = {"f", "metric", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|s", (char**)kwlist, &self->f, &metric))
+  static char const * kwlist[] = {"f", "metric", "max_leaf_size", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|si", (char**)kwlist, &self->f, &metric, &max_leaf_size))
+    return NULL;
+  if (max_leaf_size < 0 || max_leaf_size == 1) {
+    PyErr_SetString(PyExc_ValueError, "max_leaf_size must be 0 (the default) or at least 2");
     return NULL;
+  }
   if (!metric) {
     // This keeps coming up, see #368 etc
     PyErr_WarnEx(PyExc_FutureWarning, "The default argument for metric will be removed "
 		 "in future version of Annoy. Please pass metric='angular' explicitly.", 1);
-    self->ptr = new AnnoyIndex<int32_t, float, Angular, Kiss64Random, AnnoyIndexThreadedBuildPolicy>(self->f);
+    self->ptr = new AnnoyIndex<int32_t, float, Angular, Kiss64Random, AnnoyIndexThreadedBuildPolicy>(self->f, max_leaf_size);
   } else if (!strcmp(metric, "angular")) {
-   self->ptr = new AnnoyIndex<int32_t, float, Angular, Kiss64Random, AnnoyIndexThreadedBuildPolicy>(self->f);
+   self->ptr = new AnnoyIndex<int32_t, float, Angular, Kiss64Random, AnnoyIndexThreadedBuildPolicy>(self->f, max_leaf_size);
   } else if (!strcmp(metric, "euclidean")) {
-    self->ptr = new AnnoyIndex<int32_t, float, Euclidean, Kiss64Random, AnnoyIndexThreadedBuildPolicy>(self->f);
+    self->ptr = new AnnoyIndex<int32_t, float, Euclidean, Kiss64Random, AnnoyIndexThreadedBuildPolicy>(self->f, max_leaf_size);
   } else if (!strcmp(metric, "manhattan")) {
-    self->ptr = new AnnoyIndex<int32_t, float, Manhattan, Kiss64Random, AnnoyIndexThreadedBuildPolicy>(self->f);
+    self->ptr = new AnnoyIndex<int32_t, float, Manhattan, Kiss64Random, AnnoyIndexThreadedBuildPolicy>(self->f, max_leaf_size);
   } else if (!strcmp(metric, "hamming")) {
-    self->ptr = new HammingWrapper(self->f);
+    self->ptr = new HammingWrapper(self->f, max_leaf_size);
   } else if (!strcmp(metric, "dot")) {
-    self->ptr = new AnnoyIndex<int32_t, float, DotProduct, Kiss64Random, AnnoyIndexThreadedBuildPolicy>(self->f);
+    self->ptr = new AnnoyIndex<int32_t, float, DotProduct, Kiss64Random, AnnoyIndexThreadedBuildPolicy>(self->f, max_leaf_size);
   } else {
     PyErr_SetString(PyExc_ValueError, "No such metric");
     return NULL;
@@ -176,17 +305,36 @@ static int
 py_an_init(py_annoy *self, PyObject *args, PyObject *kwargs) {
   // Seems to be needed for Python 3
   const char *metric = NULL;
-  int f;
-  static char const * kwlist[] = {"f", "metric", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|s", (char**)kwlist, &f, &metric))
+  int f, max_leaf_size;
+  static char const * kwlist[] = {"f", "metric", "max_leaf_size", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|si", (char**)kwlist, &f, &metric, &max_leaf_size))
     return (int) NULL;
   return 0;
 }
 
 
+static int
+py_an_traverse(py_annoy* self, visitproc visit, void* arg) {
+  // The build callback can refer back to the index, like a method of an object that holds it
+  Py_VISIT(self->build_callback);
+  return 0;
+}
+
+
+static int
+py_an_clear(py_annoy* self) {
+  if (self->ptr)
+    self->ptr->set_build_callback(NULL, NULL);
+  Py_CLEAR(self->build_callback);
+  return 0;
+}
+
+
 static void 
 py_an_dealloc(py_annoy* self) {
+  PyObject_GC_UnTrack(self);
   delete self->ptr;
+  Py_XDECREF(self->build_callback);
   Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
@@ -204,6 +352,8 @@ py_an_load(py_annoy *self, PyObject *args, PyObject *kwargs) {
   bool prefault = false;
   if (!self->ptr) 
     return NULL;
+  if (!check_can_change(self))
+    return NULL;
   static char const * kwlist[] = {"fn", "prefault", NULL};
   if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|b", (char**)kwlist, &filename, &prefault))
     return NULL;
@@ -217,17 +367,90 @@ py_an_load(py_annoy *self, PyObject *args, PyObject *kwargs) {
 }
 
 
+static PyObject *
+py_an_prefault_async(py_annoy *self, PyObject *args, PyObject *kwargs) {
+  int n_jobs = -1;
+  if (!self->ptr) 
+    return NULL;
+  static char const * kwlist[] = {"n_jobs", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i", (char**)kwlist, &n_jobs))
+    return NULL;
+
+  // Keeps the GIL, so that another thread can't unload the index between reading its ranges and
+  // starting the threads that fault them in. Starting the threads doesn't take long.
+  self->ptr->prefault_async(n_jobs);
+  Py_RETURN_NONE;
+}
+
+
+static PyObject *
+py_an_get_prefault_progress(py_annoy *self) {
+  if (!self->ptr) 
+    return NULL;
+
+  return PyFloat_FromDouble(self->ptr->get_prefault_progress());
+}
+
+
+static PyObject *
+py_an_wait_prefault(py_annoy *self) {
+  if (!self->ptr) 
+    return NULL;
+
+  Py_BEGIN_ALLOW_THREADS;
+  self->ptr->wait_prefault();
+  Py_END_ALLOW_THREADS;
+  Py_RETURN_NONE;
+}
+
+
 static PyObject *
 py_an_save(py_annoy *self, PyObject *args, PyObject *kwargs) {
   char *filename, *error;
-  bool prefault = false;
+  bool prefault = false, reload = true, atomic = false;
   if (!self->ptr) 
     return NULL;
-  static char const * kwlist[] = {"fn", "prefault", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|b", (char**)kwlist, &filename, &prefault))
+  static char const * kwlist[] = {"fn", "prefault", "reload", "atomic", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|bbb", (char**)kwlist, &filename, &prefault, &reload, &atomic))
+    return NULL;
+  // Even without reload, the nodes can't change while they're being written
+  if (!check_can_change(self))
+    return NULL;
+
+  bool res;
+  self->n_changes++;
+  Py_BEGIN_ALLOW_THREADS;
+  res = self->ptr->save(filename, prefault, reload, atomic, &error);
+  Py_END_ALLOW_THREADS;
+  self->n_changes--;
+  if (!res) {
+    PyErr_SetString(PyExc_IOError, error);
+    free(error);
+    return NULL;
+  }
+  Py_RETURN_TRUE;
+}
+
+
+static PyObject *
+py_an_save_to_fd(py_annoy *self, PyObject *args, PyObject *kwargs) {
+  char *error;
+  int fd;
+  if (!self->ptr) 
+    return NULL;
+  static char const * kwlist[] = {"fd", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i", (char**)kwlist, &fd))
+    return NULL;
+  if (!check_can_change(self))
     return NULL;
 
-  if (!self->ptr->save(filename, prefault, &error)) {
+  bool res;
+  self->n_changes++;
+  Py_BEGIN_ALLOW_THREADS;
+  res = self->ptr->save_to_fd(fd, &error);
+  Py_END_ALLOW_THREADS;
+  self->n_changes--;
+  if (!res) {
     PyErr_SetString(PyExc_IOError, error);
     free(error);
     return NULL;
@@ -237,34 +460,80 @@ py_an_save(py_annoy *self, PyObject *args, PyObject *kwargs) {
 
 
 PyObject*
-get_nns_to_python(const vector<int32_t>& result, const vector<float>& distances, int include_distances) {
+bytes_to_python(PyObject* bytes, const char* format, Py_ssize_t rows, Py_ssize_t cols) {
+  // Returns a memoryview of the values in the bytearray bytes, which numpy.asarray wraps without copying,
+  // and releases our reference to bytes. The view has shape (rows, cols), or is 1-D if rows is -1. Views
+  // can't be cast to shapes with zeros, so empty ones are 1-D too.
+#ifdef IS_PY3K
+  PyObject* view = PyMemoryView_FromObject(bytes);
+  Py_DECREF(bytes);
+  if (view == NULL)
+    return NULL;
+  PyObject* values;
+  if (rows == -1 || !rows || !cols)
+    values = PyObject_CallMethod(view, (char*)"cast", (char*)"s", format);
+  else
+    values = PyObject_CallMethod(view, (char*)"cast", (char*)"s(nn)", format, rows, cols);
+  Py_DECREF(view);
+  return values;
+#else
+  Py_DECREF(bytes);
+  PyErr_SetString(PyExc_NotImplementedError, "Memoryviews of the results need Python 3");
+  return NULL;
+#endif
+}
+
+
+PyObject*
+array_to_python(const void* data, size_t n, size_t itemsize, const char* format) {
+  // Copies n values into a bytearray, and returns a memoryview of them
+  PyObject* bytes = PyByteArray_FromStringAndSize((const char*)data, (Py_ssize_t)(n * itemsize));
+  if (bytes == NULL)
+    return NULL;
+  return bytes_to_python(bytes, format, -1, 0);
+}
+
+
+PyObject*
+get_nns_to_python(const vector<int32_t>& result, const vector<float>& distances, int include_distances, int as_memoryview) {
   PyObject* l = NULL;
   PyObject* d = NULL;
   PyObject* t = NULL;
 
-  if ((l = PyList_New(result.size())) == NULL) {
-    goto error;
-  }
-  for (size_t i = 0; i < result.size(); i++) {
-    PyObject* res = PyInt_FromLong(result[i]);
-    if (res == NULL) {
+  if (as_memoryview) {
+    if ((l = array_to_python(result.empty() ? NULL : &result[0], result.size(), sizeof(int32_t), "i")) == NULL) {
+      goto error;
+    }
+  } else {
+    if ((l = PyList_New(result.size())) == NULL) {
       goto error;
     }
-    PyList_SetItem(l, i, res);
+    for (size_t i = 0; i < result.size(); i++) {
+      PyObject* res = PyInt_FromLong(result[i]);
+      if (res == NULL) {
+        goto error;
+      }
+      PyList_SetItem(l, i, res);
+    }
   }
   if (!include_distances)
     return l;
 
-  if ((d = PyList_New(distances.size())) == NULL) {
-    goto error;
-  }
-
-  for (size_t i = 0; i < distances.size(); i++) {
-    PyObject* dist = PyFloat_FromDouble(distances[i]);
-    if (dist == NULL) {
+  if (as_memoryview) {
+    if ((d = array_to_python(distances.empty() ? NULL : &distances[0], distances.size(), sizeof(float), "f")) == NULL) {
+      goto error;
+    }
+  } else {
+    if ((d = PyList_New(distances.size())) == NULL) {
       goto error;
     }
-    PyList_SetItem(d, i, dist);
+    for (size_t i = 0; i < distances.size(); i++) {
+      PyObject* dist = PyFloat_FromDouble(distances[i]);
+      if (dist == NULL) {
+        goto error;
+      }
+      PyList_SetItem(d, i, dist);
+    }
   }
 
   if ((t = PyTuple_Pack(2, l, d)) == NULL) {
@@ -297,12 +566,12 @@ bool check_constraints(py_annoy *self, int32_t item, bool building) {
 
 static PyObject* 
 py_an_get_nns_by_item(py_annoy *self, PyObject *args, PyObject *kwargs) {
-  int32_t item, n, search_k=-1, include_distances=0;
+  int32_t item, n, search_k=-1, include_distances=0, as_memoryview=0;
   if (!self->ptr) 
     return NULL;
 
-  static char const * kwlist[] = {"i", "n", "search_k", "include_distances", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ii|ii", (char**)kwlist, &item, &n, &search_k, &include_distances))
+  static char const * kwlist[] = {"i", "n", "search_k", "include_distances", "as_memoryview", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ii|iii", (char**)kwlist, &item, &n, &search_k, &include_distances, &as_memoryview))
     return NULL;
 
   if (!check_constraints(self, item, false)) {
@@ -316,7 +585,51 @@ py_an_get_nns_by_item(py_annoy *self, PyObject *args, PyObject *kwargs) {
   self->ptr->get_nns_by_item(item, n, search_k, &result, include_distances ? &distances : NULL);
   Py_END_ALLOW_THREADS;
 
-  return get_nns_to_python(result, distances, include_distances);
+  return get_nns_to_python(result, distances, include_distances, as_memoryview);
+}
+
+
+int
+convert_packed_vectors(py_annoy *self, PyObject* v, int ndim, vector<uint64_t>* w, size_t* n_rows) {
+  // Reads the packed vectors of Hamming indexes: bytes or uint8 buffers with (f + 7) / 8 bytes per row, where
+  // bit j of byte k is dimension 8 * k + j (numpy.packbits with bitorder="little"), or uint64 buffers with
+  // (f + 63) / 64 words per row, like the index stores them. Rows of length f are float vectors instead.
+  // Returns 1 if v was packed, 0 if it should be read as floats, and -1 with an exception set.
+  if (!PyObject_CheckBuffer(v))
+    return 0;
+  Py_buffer view;
+  if (PyObject_GetBuffer(v, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == -1) {
+    PyErr_Clear();
+    return 0;
+  }
+  const char* format = view.format ? view.format : "B";
+  char type = format[strlen(format) - 1];
+  size_t n_words = (self->f + 63) / 64;
+  Py_ssize_t length = view.ndim == ndim ? view.shape[ndim - 1] : -1;
+  bool is_bytes = type == 'B' && view.itemsize == 1 && length == (self->f + 7) / 8;
+  bool is_words = strchr("LQ", type) && view.itemsize == 8 && !strchr(">!", format[0]) && length == (Py_ssize_t)n_words;
+  if (length == self->f || (!is_bytes && !is_words)) {
+    PyBuffer_Release(&view);
+    return 0;
+  }
+
+  *n_rows = ndim == 2 ? (size_t)view.shape[0] : 1;
+  w->assign(*n_rows * n_words, 0);
+  const unsigned char* src = (const unsigned char*)view.buf;
+  for (size_t r = 0; r < *n_rows; r++) {
+    uint64_t* dst = &(*w)[r * n_words];
+    if (is_words) {
+      memcpy(dst, &src[r * n_words * 8], n_words * 8);
+    } else {
+      for (Py_ssize_t k = 0; k < length; k++)
+        dst[k / 8] |= (uint64_t)src[r * length + k] << (8 * (k % 8));
+    }
+    // The bits after the last dimension would add to the distances
+    if (self->f % 64)
+      dst[n_words - 1] &= ((uint64_t)1 << (self->f % 64)) - 1;
+  }
+  PyBuffer_Release(&view);
+  return 1;
 }
 
 
@@ -351,47 +664,161 @@ convert_list_to_vector(PyObject* v, int f, vector<float>* w) {
   return true;
 }
 
+bool
+get_vectors_buffer(py_annoy *self, PyObject* vectors, Py_buffer* view) {
+  // The vectors are read straight from the buffer, so they need to be float32 already
+  if (PyObject_GetBuffer(vectors, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == -1)
+    return false;
+  const char* format = view->format ? view->format : "B";
+  bool is_float32 = format[strlen(format) - 1] == 'f' && view->itemsize == 4 && !strchr(">!", format[0]);
+  if (!is_float32 || view->ndim != 2 || view->shape[1] != self->f) {
+    PyErr_Format(PyExc_ValueError, "vectors must be a C-contiguous float32 array of shape (n, %d)", self->f);
+    PyBuffer_Release(view);
+    return false;
+  }
+  return true;
+}
+
 static PyObject* 
 py_an_get_nns_by_vector(py_annoy *self, PyObject *args, PyObject *kwargs) {
   PyObject* v;
-  int32_t n, search_k=-1, include_distances=0;
+  int32_t n, search_k=-1, include_distances=0, as_memoryview=0;
   if (!self->ptr) 
     return NULL;
 
-  static char const * kwlist[] = {"vector", "n", "search_k", "include_distances", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|ii", (char**)kwlist, &v, &n, &search_k, &include_distances))
+  static char const * kwlist[] = {"vector", "n", "search_k", "include_distances", "as_memoryview", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|iii", (char**)kwlist, &v, &n, &search_k, &include_distances, &as_memoryview))
+    return NULL;
+
+  vector<int32_t> result;
+  vector<float> distances;
+
+  HammingWrapper* hamming = dynamic_cast<HammingWrapper*>(self->ptr);
+  vector<uint64_t> packed;
+  size_t n_rows;
+  int is_packed = hamming ? convert_packed_vectors(self, v, 1, &packed, &n_rows) : 0;
+  if (is_packed == -1)
     return NULL;
+  if (is_packed) {
+    Py_BEGIN_ALLOW_THREADS;
+    hamming->get_nns_by_packed_vector(&packed[0], n, search_k, &result, include_distances ? &distances : NULL);
+    Py_END_ALLOW_THREADS;
+    return get_nns_to_python(result, distances, include_distances, as_memoryview);
+  }
 
   vector<float> w(self->f);
   if (!convert_list_to_vector(v, self->f, &w)) {
     return NULL;
   }
 
-  vector<int32_t> result;
-  vector<float> distances;
-
   Py_BEGIN_ALLOW_THREADS;
   self->ptr->get_nns_by_vector(&w[0], n, search_k, &result, include_distances ? &distances : NULL);
   Py_END_ALLOW_THREADS;
 
-  return get_nns_to_python(result, distances, include_distances);
+  return get_nns_to_python(result, distances, include_distances, as_memoryview);
 }
 
 
 static PyObject* 
-py_an_get_item_vector(py_annoy *self, PyObject *args) {
-  int32_t item;
+py_an_get_nns_by_vector_batch(py_annoy *self, PyObject *args, PyObject *kwargs) {
+  PyObject* vectors;
+  int32_t n, search_k=-1, include_distances=0, n_jobs=-1;
   if (!self->ptr) 
     return NULL;
-  if (!PyArg_ParseTuple(args, "i", &item))
+
+  static char const * kwlist[] = {"vectors", "n", "search_k", "include_distances", "n_jobs", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|iii", (char**)kwlist, &vectors, &n, &search_k, &include_distances, &n_jobs))
+    return NULL;
+  if (n < 0) {
+    PyErr_SetString(PyExc_ValueError, "n can't be negative");
+    return NULL;
+  }
+
+  HammingWrapper* hamming = dynamic_cast<HammingWrapper*>(self->ptr);
+  vector<uint64_t> packed;
+  size_t n_queries;
+  int is_packed = hamming ? convert_packed_vectors(self, vectors, 2, &packed, &n_queries) : 0;
+  if (is_packed == -1)
+    return NULL;
+  Py_buffer view;
+  view.obj = NULL;
+  if (!is_packed) {
+    if (!get_vectors_buffer(self, vectors, &view))
+      return NULL;
+    n_queries = (size_t)view.shape[0];
+  }
+
+  // The results are written right into the bytearrays we return, with the GIL released for all queries
+  PyObject* ids = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)(n_queries * n * sizeof(int32_t)));
+  PyObject* distances = include_distances ? PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)(n_queries * n * sizeof(float))) : NULL;
+  if (ids == NULL || (include_distances && distances == NULL)) {
+    Py_XDECREF(ids);
+    Py_XDECREF(distances);
+    if (!is_packed)
+      PyBuffer_Release(&view);
+    return NULL;
+  }
+  int32_t* ids_data = (int32_t*)PyByteArray_AS_STRING(ids);
+  float* distances_data = distances ? (float*)PyByteArray_AS_STRING(distances) : NULL;
+
+  Py_BEGIN_ALLOW_THREADS;
+  if (is_packed)
+    hamming->get_nns_by_packed_vectors(n_queries ? &packed[0] : NULL, n_queries, n, search_k, ids_data, distances_data, n_jobs);
+  else
+    self->ptr->get_nns_by_vectors((const float*)view.buf, n_queries, n, search_k, ids_data, distances_data, n_jobs);
+  Py_END_ALLOW_THREADS;
+  if (!is_packed)
+    PyBuffer_Release(&view);
+
+  PyObject* l = bytes_to_python(ids, "i", (Py_ssize_t)n_queries, n);
+  if (!include_distances || l == NULL) {
+    Py_XDECREF(distances);
+    return l;
+  }
+  PyObject* d = bytes_to_python(distances, "f", (Py_ssize_t)n_queries, n);
+  if (d == NULL) {
+    Py_DECREF(l);
+    return NULL;
+  }
+  PyObject* t = PyTuple_Pack(2, l, d);
+  Py_DECREF(l);
+  Py_DECREF(d);
+  return t;
+}
+
+
+static PyObject* 
+py_an_get_item_vector(py_annoy *self, PyObject *args, PyObject *kwargs) {
+  int32_t item, as_memoryview=0, packed=0;
+  if (!self->ptr) 
+    return NULL;
+  static char const * kwlist[] = {"i", "as_memoryview", "packed", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|ii", (char**)kwlist, &item, &as_memoryview, &packed))
     return NULL;
 
   if (!check_constraints(self, item, false)) {
     return NULL;
   }
 
+  if (packed) {
+    // The bytes of convert_packed_vectors
+    HammingWrapper* hamming = dynamic_cast<HammingWrapper*>(self->ptr);
+    if (!hamming) {
+      PyErr_SetString(PyExc_ValueError, "Only hamming indexes have packed vectors");
+      return NULL;
+    }
+    vector<uint64_t> words((self->f + 63) / 64);
+    hamming->get_item_packed(item, &words[0]);
+    vector<unsigned char> bytes((self->f + 7) / 8);
+    for (size_t k = 0; k < bytes.size(); k++)
+      bytes[k] = (unsigned char)(words[k / 8] >> (8 * (k % 8)));
+    return PyBytes_FromStringAndSize((const char*)&bytes[0], bytes.size());
+  }
+
   vector<float> v(self->f);
   self->ptr->get_item(item, &v[0]);
+  if (as_memoryview)
+    return array_to_python(&v[0], self->f, sizeof(float), "f");
   PyObject* l = PyList_New(self->f);
   if (l == NULL) {
     return NULL;
@@ -412,12 +839,78 @@ py_an_get_item_vector(py_annoy *self, PyObject *args) {
 }
 
 
+static int
+py_an_getbuffer(py_annoy *self, Py_buffer *view, int flags) {
+  // Exports the item vectors as an n_items x f array of floats. Items are stored together with the
+  // nodes of the trees, so the rows are strided.
+  if (!self->ptr) {
+    PyErr_SetString(PyExc_BufferError, "The index is not initialized");
+    return -1;
+  }
+  if (flags & PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "The item vectors are read-only");
+    return -1;
+  }
+  if ((flags & PyBUF_STRIDES) != PyBUF_STRIDES) {
+    PyErr_SetString(PyExc_BufferError, "The item vectors need a strided buffer");
+    return -1;
+  }
+  if (self->n_changes > 0) {
+    // E.g. from the build callback, or another thread
+    PyErr_SetString(PyExc_BufferError, "The item vectors can't be viewed while the index is being changed");
+    return -1;
+  }
+  size_t stride;
+  static float empty;
+  const float* vectors = self->ptr->get_item_vectors(&stride);
+  if (!stride) {
+    PyErr_SetString(PyExc_BufferError, "Hamming indexes store their items as packed bits");
+    return -1;
+  }
+  self->export_shape[0] = self->ptr->get_n_items();
+  self->export_shape[1] = self->f;
+  self->export_strides[0] = (Py_ssize_t)stride;
+  self->export_strides[1] = sizeof(float);
+
+  view->obj = (PyObject*)self;
+  Py_INCREF(self);
+  view->buf = (void*)(vectors ? vectors : &empty);
+  view->len = self->export_shape[0] * self->export_shape[1] * sizeof(float);
+  view->readonly = 1;
+  view->itemsize = sizeof(float);
+  view->format = (flags & PyBUF_FORMAT) ? (char*)"f" : NULL;
+  view->ndim = 2;
+  view->shape = self->export_shape;
+  view->strides = self->export_strides;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  self->n_exports++;
+  return 0;
+}
+
+
+static void
+py_an_releasebuffer(py_annoy *self, Py_buffer *view) {
+  self->n_exports--;
+}
+
+
+static PyObject *
+py_an_get_item_vectors(py_annoy *self) {
+  if (!self->ptr) 
+    return NULL;
+  return PyMemoryView_FromObject((PyObject*)self);
+}
+
+
 static PyObject* 
 py_an_add_item(py_annoy *self, PyObject *args, PyObject* kwargs) {
   PyObject* v;
   int32_t item;
   if (!self->ptr) 
     return NULL;
+  if (!check_can_change(self))
+    return NULL;
   static char const * kwlist[] = {"i", "vector", NULL};
   if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iO", (char**)kwlist, &item, &v))
     return NULL;
@@ -426,11 +919,26 @@ py_an_add_item(py_annoy *self, PyObject *args, PyObject* kwargs) {
     return NULL;
   }
 
+  char* error;
+  HammingWrapper* hamming = dynamic_cast<HammingWrapper*>(self->ptr);
+  vector<uint64_t> packed;
+  size_t n_rows;
+  int is_packed = hamming ? convert_packed_vectors(self, v, 1, &packed, &n_rows) : 0;
+  if (is_packed == -1)
+    return NULL;
+  if (is_packed) {
+    if (!hamming->add_item_packed(item, &packed[0], &error)) {
+      PyErr_SetString(PyExc_Exception, error);
+      free(error);
+      return NULL;
+    }
+    Py_RETURN_NONE;
+  }
+
   vector<float> w(self->f);
   if (!convert_list_to_vector(v, self->f, &w)) {
     return NULL;
   }
-  char* error;
   if (!self->ptr->add_item(item, &w[0], &error)) {
     PyErr_SetString(PyExc_Exception, error);
     free(error);
@@ -440,54 +948,379 @@ py_an_add_item(py_annoy *self, PyObject *args, PyObject* kwargs) {
   Py_RETURN_NONE;
 }
 
+bool
+convert_ids_to_vector(PyObject* ids, size_t n, vector<int32_t>* items) {
+  // Reads int32 and int64 buffers (such as numpy arrays) directly, and anything else as a sequence of ints
+  Py_buffer view;
+  if (PyObject_CheckBuffer(ids) && PyObject_GetBuffer(ids, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == 0) {
+    char type = view.format ? view.format[strlen(view.format) - 1] : 'B';
+    bool is_int = strchr("ilqILQ", type) && (view.itemsize == 4 || view.itemsize == 8) && view.ndim == 1;
+    if (is_int && (size_t)view.shape[0] == n) {
+      items->resize(n);
+      bool is_unsigned = strchr("ILQ", type) != NULL;
+      for (size_t i = 0; i < n; i++) {
+        long long item;
+        if (view.itemsize == 4)
+          item = is_unsigned ? (long long)((uint32_t*)view.buf)[i] : ((int32_t*)view.buf)[i];
+        else
+          item = is_unsigned ? (long long)std::min(((uint64_t*)view.buf)[i], (uint64_t)INT64_MAX) : ((int64_t*)view.buf)[i];
+        if (item < 0 || item > INT32_MAX) {
+          PyErr_SetString(PyExc_IndexError, item < 0 ? "Item index can not be negative" : "Item index is too large");
+          PyBuffer_Release(&view);
+          return false;
+        }
+        (*items)[i] = (int32_t)item;
+      }
+      PyBuffer_Release(&view);
+      return true;
+    }
+    PyBuffer_Release(&view);
+  }
+  PyErr_Clear();
+
+  PyObject* seq = PySequence_Fast(ids, "ids must be a sequence of integers");
+  if (seq == NULL) {
+    return false;
+  }
+  if ((size_t)PySequence_Fast_GET_SIZE(seq) != n) {
+    PyErr_SetString(PyExc_ValueError, "ids and vectors must have the same length");
+    Py_DECREF(seq);
+    return false;
+  }
+  items->resize(n);
+  for (size_t i = 0; i < n; i++) {
+    long item = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+    if (item == -1 && PyErr_Occurred()) {
+      Py_DECREF(seq);
+      return false;
+    }
+    if (item < 0 || item > INT32_MAX) {
+      PyErr_SetString(PyExc_IndexError, item < 0 ? "Item index can not be negative" : "Item index is too large");
+      Py_DECREF(seq);
+      return false;
+    }
+    (*items)[i] = (int32_t)item;
+  }
+  Py_DECREF(seq);
+  return true;
+}
+
 static PyObject *
-py_an_on_disk_build(py_annoy *self, PyObject *args, PyObject *kwargs) {
-  char *filename, *error;
+py_an_add_items(py_annoy *self, PyObject *args, PyObject* kwargs) {
+  PyObject* ids;
+  PyObject* vectors;
+  int n_jobs = -1;
   if (!self->ptr)
     return NULL;
-  static char const * kwlist[] = {"fn", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s", (char**)kwlist, &filename))
+  if (!check_can_change(self))
+    return NULL;
+  static char const * kwlist[] = {"ids", "vectors", "n_jobs", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|i", (char**)kwlist, &ids, &vectors, &n_jobs))
     return NULL;
 
-  if (!self->ptr->on_disk_build(filename, &error)) {
-    PyErr_SetString(PyExc_IOError, error);
-    free(error);
+  Py_buffer view;
+  if (!get_vectors_buffer(self, vectors, &view))
+    return NULL;
+  // The vectors may be a view of this very index
+  if (!check_can_change(self)) {
+    PyBuffer_Release(&view);
     return NULL;
   }
-  Py_RETURN_TRUE;
-}
+  size_t n = (size_t)view.shape[0];
 
-static PyObject *
-py_an_build(py_annoy *self, PyObject *args, PyObject *kwargs) {
-  int q;
-  int n_jobs = -1;
-  if (!self->ptr) 
-    return NULL;
-  static char const * kwlist[] = {"n_trees", "n_jobs", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|i", (char**)kwlist, &q, &n_jobs))
+  vector<int32_t> items;
+  if (!convert_ids_to_vector(ids, n, &items)) {
+    PyBuffer_Release(&view);
     return NULL;
+  }
 
   bool res;
   char* error;
+  self->n_changes++;
   Py_BEGIN_ALLOW_THREADS;
-  res = self->ptr->build(q, n_jobs, &error);
+  res = self->ptr->add_items(n ? &items[0] : NULL, (const float*)view.buf, n, n_jobs, &error);
   Py_END_ALLOW_THREADS;
+  self->n_changes--;
+  PyBuffer_Release(&view);
   if (!res) {
     PyErr_SetString(PyExc_Exception, error);
     free(error);
     return NULL;
   }
 
-  Py_RETURN_TRUE;
+  Py_RETURN_NONE;
 }
 
-
 static PyObject *
-py_an_unbuild(py_annoy *self) {
-  if (!self->ptr) 
+py_an_add_items_from_file(py_annoy *self, PyObject *args, PyObject* kwargs) {
+  char *filename, *error;
+  const char *format = NULL;
+  int n_jobs = -1;
+  if (!self->ptr)
+    return NULL;
+  if (!check_can_change(self))
+    return NULL;
+  static char const * kwlist[] = {"fn", "format", "n_jobs", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|si", (char**)kwlist, &filename, &format, &n_jobs))
     return NULL;
 
-  char* error;
+  bool res;
+  self->n_changes++;
+  Py_BEGIN_ALLOW_THREADS;
+  res = self->ptr->add_items_from_file(filename, format, n_jobs, &error);
+  Py_END_ALLOW_THREADS;
+  self->n_changes--;
+  if (!res) {
+    PyErr_SetString(PyExc_IOError, error);
+    free(error);
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+py_an_on_disk_build(py_annoy *self, PyObject *args, PyObject *kwargs) {
+  char *filename, *error;
+  if (!self->ptr)
+    return NULL;
+  if (!check_can_change(self))
+    return NULL;
+  static char const * kwlist[] = {"fn", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s", (char**)kwlist, &filename))
+    return NULL;
+
+  if (!self->ptr->on_disk_build(filename, &error)) {
+    PyErr_SetString(PyExc_IOError, error);
+    free(error);
+    return NULL;
+  }
+  Py_RETURN_TRUE;
+}
+
+static PyObject *
+py_an_build(py_annoy *self, PyObject *args, PyObject *kwargs) {
+  int q;
+  int n_jobs = -1;
+  unsigned long long memory_budget = 0;
+  if (!self->ptr) 
+    return NULL;
+  if (!check_can_change(self))
+    return NULL;
+  static char const * kwlist[] = {"n_trees", "n_jobs", "memory_budget", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|iK", (char**)kwlist, &q, &n_jobs, &memory_budget))
+    return NULL;
+
+  if (memory_budget && q != -1) {
+    PyErr_SetString(PyExc_ValueError, "Pass n_trees=-1 when building with a memory budget");
+    return NULL;
+  }
+
+  bool res;
+  char* error;
+  self->n_changes++;
+  Py_BEGIN_ALLOW_THREADS;
+  if (memory_budget)
+    res = self->ptr->build_with_memory_budget((size_t)memory_budget, n_jobs, &error);
+  else
+    res = self->ptr->build(q, n_jobs, &error);
+  Py_END_ALLOW_THREADS;
+  self->n_changes--;
+  if (!res) {
+    PyErr_SetString(PyExc_Exception, error);
+    free(error);
+    return NULL;
+  }
+
+  Py_RETURN_TRUE;
+}
+
+
+static PyObject *
+py_an_add_trees(py_annoy *self, PyObject *args, PyObject *kwargs) {
+  int q;
+  int n_jobs = -1;
+  if (!self->ptr)
+    return NULL;
+  if (!check_can_change(self))
+    return NULL;
+  static char const * kwlist[] = {"n_trees", "n_jobs", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|i", (char**)kwlist, &q, &n_jobs))
+    return NULL;
+
+  bool res;
+  char* error;
+  self->n_changes++;
+  Py_BEGIN_ALLOW_THREADS;
+  res = self->ptr->add_trees(q, n_jobs, &error);
+  Py_END_ALLOW_THREADS;
+  self->n_changes--;
+  if (!res) {
+    PyErr_SetString(PyExc_Exception, error);
+    free(error);
+    return NULL;
+  }
+
+  Py_RETURN_TRUE;
+}
+
+
+static PyObject *
+py_an_insert_item(py_annoy *self, PyObject *args, PyObject* kwargs) {
+  PyObject* v;
+  int32_t item;
+  if (!self->ptr) 
+    return NULL;
+  if (!check_can_change(self))
+    return NULL;
+  static char const * kwlist[] = {"i", "vector", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iO", (char**)kwlist, &item, &v))
+    return NULL;
+
+  if (!check_constraints(self, item, true)) {
+    return NULL;
+  }
+
+  char* error;
+  HammingWrapper* hamming = dynamic_cast<HammingWrapper*>(self->ptr);
+  vector<uint64_t> packed;
+  size_t n_rows;
+  int is_packed = hamming ? convert_packed_vectors(self, v, 1, &packed, &n_rows) : 0;
+  if (is_packed == -1)
+    return NULL;
+  if (is_packed) {
+    if (!hamming->insert_item_packed(item, &packed[0], &error)) {
+      PyErr_SetString(PyExc_Exception, error);
+      free(error);
+      return NULL;
+    }
+    Py_RETURN_NONE;
+  }
+
+  vector<float> w(self->f);
+  if (!convert_list_to_vector(v, self->f, &w)) {
+    return NULL;
+  }
+  if (!self->ptr->insert_item(item, &w[0], &error)) {
+    PyErr_SetString(PyExc_Exception, error);
+    free(error);
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+
+static PyObject *
+py_an_mark_deleted(py_annoy *self, PyObject *args) {
+  int32_t item;
+  if (!self->ptr) 
+    return NULL;
+  if (!check_can_change(self))
+    return NULL;
+  if (!PyArg_ParseTuple(args, "i", &item))
+    return NULL;
+
+  if (!check_constraints(self, item, false)) {
+    return NULL;
+  }
+
+  char* error;
+  if (!self->ptr->mark_deleted(item, &error)) {
+    PyErr_SetString(PyExc_Exception, error);
+    free(error);
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+
+static PyObject *
+py_an_compact(py_annoy *self) {
+  if (!self->ptr) 
+    return NULL;
+  if (!check_can_change(self))
+    return NULL;
+
+  bool res;
+  char* error;
+  self->n_changes++;
+  Py_BEGIN_ALLOW_THREADS;
+  res = self->ptr->compact(&error);
+  Py_END_ALLOW_THREADS;
+  self->n_changes--;
+  if (!res) {
+    PyErr_SetString(PyExc_Exception, error);
+    free(error);
+    return NULL;
+  }
+
+  Py_RETURN_TRUE;
+}
+
+
+static PyObject *
+merge_indexes(py_annoy *self, PyObject *args, bool trees_only) {
+  if (!self->ptr) 
+    return NULL;
+  if (!check_can_change(self))
+    return NULL;
+
+  // Subclasses of Annoy (such as AnnoyIndex) can be merged with each other
+  PyTypeObject* annoy_type = Py_TYPE(self);
+  while (annoy_type->tp_base && annoy_type->tp_base != &PyBaseObject_Type)
+    annoy_type = annoy_type->tp_base;
+
+  vector<py_annoy*> others;
+  for (Py_ssize_t i = 0; i < PyTuple_Size(args); i++) {
+    PyObject* other = PyTuple_GetItem(args, i);
+    if (!PyObject_TypeCheck(other, annoy_type) || !((py_annoy*)other)->ptr) {
+      PyErr_SetString(PyExc_TypeError, "Only Annoy indexes can be merged");
+      return NULL;
+    }
+    others.push_back((py_annoy*)other);
+  }
+
+  for (size_t i = 0; i < others.size(); i++) {
+    bool res;
+    char* error;
+    self->n_changes++;
+    Py_BEGIN_ALLOW_THREADS;
+    res = trees_only ? self->ptr->merge_trees(others[i]->ptr, &error) : self->ptr->merge(others[i]->ptr, &error);
+    Py_END_ALLOW_THREADS;
+    self->n_changes--;
+    if (!res) {
+      PyErr_SetString(PyExc_Exception, error);
+      free(error);
+      return NULL;
+    }
+  }
+
+  Py_RETURN_TRUE;
+}
+
+
+static PyObject *
+py_an_merge(py_annoy *self, PyObject *args) {
+  return merge_indexes(self, args, false);
+}
+
+
+static PyObject *
+py_an_merge_trees(py_annoy *self, PyObject *args) {
+  return merge_indexes(self, args, true);
+}
+
+
+static PyObject *
+py_an_unbuild(py_annoy *self) {
+  if (!self->ptr) 
+    return NULL;
+  if (!check_can_change(self))
+    return NULL;
+
+  char* error;
   if (!self->ptr->unbuild(&error)) {
     PyErr_SetString(PyExc_Exception, error);
     free(error);
@@ -502,6 +1335,8 @@ static PyObject *
 py_an_unload(py_annoy *self) {
   if (!self->ptr) 
     return NULL;
+  if (!check_can_change(self))
+    return NULL;
 
   self->ptr->unload();
 
@@ -544,6 +1379,115 @@ py_an_get_n_trees(py_annoy *self) {
   return PyInt_FromLong(n);
 }
 
+static PyObject *
+sizes_to_python(const vector<size_t>& sizes) {
+  PyObject* l = PyList_New(sizes.size());
+  if (l == NULL)
+    return NULL;
+  for (size_t i = 0; i < sizes.size(); i++) {
+    PyObject* size = PyLong_FromSize_t(sizes[i]);
+    if (size == NULL) {
+      Py_DECREF(l);
+      return NULL;
+    }
+    PyList_SetItem(l, i, size);
+  }
+  return l;
+}
+
+static PyObject *
+py_an_get_tree_stats(py_annoy *self, PyObject *args) {
+  int32_t tree;
+  if (!self->ptr) 
+    return NULL;
+  if (!PyArg_ParseTuple(args, "i", &tree))
+    return NULL;
+  if (tree < 0 || tree >= self->ptr->get_n_trees()) {
+    PyErr_SetString(PyExc_IndexError, "Tree index out of range");
+    return NULL;
+  }
+
+  AnnoyTreeStats stats;
+  char* error;
+  bool res;
+  Py_BEGIN_ALLOW_THREADS;
+  res = self->ptr->get_tree_stats(tree, &stats, &error);
+  Py_END_ALLOW_THREADS;
+  if (!res) {
+    PyErr_SetString(PyExc_Exception, error);
+    free(error);
+    return NULL;
+  }
+
+  PyObject* depths = sizes_to_python(stats.depths);
+  PyObject* leaf_sizes = sizes_to_python(stats.leaf_sizes);
+  PyObject* imbalance = sizes_to_python(stats.imbalance);
+  PyObject* d = NULL;
+  if (depths && leaf_sizes && imbalance)
+    d = Py_BuildValue("{s:n,s:n,s:n,s:O,s:O,s:O,s:d}",
+                      "n_split_nodes", (Py_ssize_t)stats.n_split_nodes,
+                      "n_leaves", (Py_ssize_t)stats.n_leaves,
+                      "n_random_splits", (Py_ssize_t)stats.n_random_splits,
+                      "depths", depths,
+                      "leaf_sizes", leaf_sizes,
+                      "imbalance", imbalance,
+                      "mean_imbalance", stats.mean_imbalance);
+  Py_XDECREF(depths);
+  Py_XDECREF(leaf_sizes);
+  Py_XDECREF(imbalance);
+  return d;
+}
+
+static PyObject *
+py_an_get_candidate_stats(py_annoy *self, PyObject *args, PyObject *kwargs) {
+  int32_t n_queries = 100, n = 10, search_k = -1;
+  if (!self->ptr) 
+    return NULL;
+  static char const * kwlist[] = {"n_queries", "n", "search_k", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iii", (char**)kwlist, &n_queries, &n, &search_k))
+    return NULL;
+  if (n_queries < 0 || n < 0) {
+    PyErr_SetString(PyExc_ValueError, "n_queries and n can't be negative");
+    return NULL;
+  }
+
+  AnnoyCandidateStats stats;
+  Py_BEGIN_ALLOW_THREADS;
+  self->ptr->get_candidate_stats(n_queries, n, search_k, &stats);
+  Py_END_ALLOW_THREADS;
+
+  return Py_BuildValue("{s:n,s:n,s:n,s:d}",
+                       "n_queries", (Py_ssize_t)stats.n_queries,
+                       "n_candidates", (Py_ssize_t)stats.n_candidates,
+                       "n_unique", (Py_ssize_t)stats.n_unique,
+                       "duplicate_rate", stats.n_candidates ? 1.0 - (double)stats.n_unique / stats.n_candidates : 0.0);
+}
+
+static PyObject *
+py_an_get_max_leaf_size(py_annoy *self) {
+  if (!self->ptr) 
+    return NULL;
+
+  int32_t n = self->ptr->get_max_leaf_size();
+  return PyInt_FromLong(n);
+}
+
+static PyObject *
+py_an_get_memory_usage(py_annoy *self) {
+  if (!self->ptr) 
+    return NULL;
+
+  AnnoyMemoryUsage usage;
+  self->ptr->get_memory_usage(&usage);
+  return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K}",
+    "item_vectors", (unsigned long long)usage.item_vectors,
+    "split_nodes", (unsigned long long)usage.split_nodes,
+    "leaf_buckets", (unsigned long long)usage.leaf_buckets,
+    "root_copies", (unsigned long long)usage.root_copies,
+    "slack", (unsigned long long)usage.slack,
+    "total", (unsigned long long)usage.total);
+}
+
 static PyObject *
 py_an_verbose(py_annoy *self, PyObject *args) {
   int verbose;
@@ -572,26 +1516,227 @@ py_an_set_seed(py_annoy *self, PyObject *args) {
 }
 
 
+static PyObject *
+py_an_set_split_sample_size(py_annoy *self, PyObject *args) {
+  int n;
+  if (!self->ptr)
+    return NULL;
+  if (!PyArg_ParseTuple(args, "i", &n))
+    return NULL;
+
+  if (n < 0) {
+    PyErr_SetString(PyExc_ValueError, "The split sample size can not be negative");
+    return NULL;
+  }
+
+  char* error;
+  if (!self->ptr->set_split_sample_size((size_t)n, &error)) {
+    PyErr_SetString(PyExc_ValueError, error);
+    free(error);
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+
+static PyObject *
+py_an_set_out_of_core_memory(py_annoy *self, PyObject *args) {
+  unsigned long long memory;
+  if (!self->ptr)
+    return NULL;
+  if (!PyArg_ParseTuple(args, "K", &memory))
+    return NULL;
+
+  self->ptr->set_out_of_core_memory((size_t)memory);
+
+  Py_RETURN_NONE;
+}
+
+
+static PyObject *
+py_an_set_projection(py_annoy *self, PyObject *args) {
+  int n_components;
+  if (!self->ptr)
+    return NULL;
+  if (!PyArg_ParseTuple(args, "i", &n_components))
+    return NULL;
+
+  char* error;
+  if (!self->ptr->set_projection(n_components, &error)) {
+    PyErr_SetString(PyExc_Exception, error);
+    free(error);
+    return NULL;
+  }
+
+  Py_RETURN_NONE;
+}
+
+
+static PyObject *
+py_an_get_projection(py_annoy *self) {
+  if (!self->ptr)
+    return NULL;
+
+  vector<float> components((size_t)self->ptr->get_projection(NULL) * self->f);
+  int n_components = self->ptr->get_projection(components.empty() ? NULL : &components[0]);
+  PyObject* l = PyList_New(n_components);
+  if (l == NULL)
+    return NULL;
+  for (int k = 0; k < n_components; k++) {
+    PyObject* component = PyList_New(self->f);
+    if (component == NULL) {
+      Py_DECREF(l);
+      return NULL;
+    }
+    for (int z = 0; z < self->f; z++)
+      PyList_SetItem(component, z, PyFloat_FromDouble(components[(size_t)k * self->f + z]));
+    PyList_SetItem(l, k, component);
+  }
+  return l;
+}
+
+
+static PyObject *
+py_an_set_deterministic_build(py_annoy *self, PyObject *args) {
+  int deterministic = 1;
+  if (!self->ptr)
+    return NULL;
+  if (!PyArg_ParseTuple(args, "|p", &deterministic))
+    return NULL;
+
+  self->ptr->set_deterministic_build(deterministic);
+
+  Py_RETURN_NONE;
+}
+
+
+static bool
+py_an_build_callback(const AnnoyBuildProgress* progress, void* arg) {
+  // Called from the build threads, which don't hold the GIL
+  py_annoy* self = (py_annoy*)arg;
+  PyGILState_STATE gstate = PyGILState_Ensure();
+  bool res = true;
+  PyObject* callback = self->build_callback;
+  if (callback) {
+    Py_INCREF(callback);
+    PyObject* d = Py_BuildValue("{s:n,s:n,s:n,s:d,s:d}",
+                                "n_trees", (Py_ssize_t)progress->n_trees,
+                                "n_trees_total", (Py_ssize_t)progress->n_trees_total,
+                                "n_nodes", (Py_ssize_t)progress->n_nodes,
+                                "elapsed", progress->elapsed,
+                                "eta", progress->eta);
+    PyObject* r = d ? PyObject_CallFunctionObjArgs(callback, d, NULL) : NULL;
+    if (!r) {
+      // The build can't raise the exception, so we report it and stop the build
+      PyErr_WriteUnraisable(callback);
+      res = false;
+    } else {
+      res = (r != Py_False);
+    }
+    Py_XDECREF(r);
+    Py_XDECREF(d);
+    Py_DECREF(callback);
+  }
+  PyGILState_Release(gstate);
+  return res;
+}
+
+
+static PyObject *
+py_an_set_build_callback(py_annoy *self, PyObject *args) {
+  PyObject* callback;
+  if (!self->ptr)
+    return NULL;
+  if (!PyArg_ParseTuple(args, "O", &callback))
+    return NULL;
+
+  if (callback != Py_None && !PyCallable_Check(callback)) {
+    PyErr_SetString(PyExc_TypeError, "The build callback must be callable or None");
+    return NULL;
+  }
+
+  Py_CLEAR(self->build_callback);
+  if (callback == Py_None) {
+    self->ptr->set_build_callback(NULL, NULL);
+  } else {
+    Py_INCREF(callback);
+    self->build_callback = callback;
+    self->ptr->set_build_callback(py_an_build_callback, self);
+  }
+
+  Py_RETURN_NONE;
+}
+
+
+static PyObject *
+py_an_cancel_build(py_annoy *self) {
+  if (!self->ptr)
+    return NULL;
+
+  self->ptr->cancel_build();
+
+  Py_RETURN_NONE;
+}
+
+
 static PyMethodDef AnnoyMethods[] = {
   {"load",	(PyCFunction)py_an_load, METH_VARARGS | METH_KEYWORDS, "Loads (mmaps) an index from disk."},
-  {"save",	(PyCFunction)py_an_save, METH_VARARGS | METH_KEYWORDS, "Saves the index to disk."},
+  {"prefault_async",	(PyCFunction)py_an_prefault_async, METH_VARARGS | METH_KEYWORDS, "Prefaults a loaded index in the background using `n_jobs` threads.\n\nTree nodes are read first, then item vectors. Queries can run while this is in progress.\n`n_jobs=-1` uses all available CPU cores."},
+  {"get_prefault_progress",	(PyCFunction)py_an_get_prefault_progress, METH_NOARGS, "Returns the fraction (between 0 and 1) of the index that has been prefaulted by `prefault_async`."},
+  {"wait_prefault",	(PyCFunction)py_an_wait_prefault, METH_NOARGS, "Blocks until `prefault_async` has finished."},
+  {"save",	(PyCFunction)py_an_save, METH_VARARGS | METH_KEYWORDS, "Saves the index to disk.\n\n:param reload: If `True` (default), the index is unloaded and the saved file is mmapped.\nIf `False`, the index stays in memory as it is.\n\n:param atomic: If `True`, the index is written to a temporary file that is then renamed to `fn`."},
+  {"save_to_fd",	(PyCFunction)py_an_save_to_fd, METH_VARARGS | METH_KEYWORDS, "Writes the index to the file descriptor `fd` (a file, pipe or socket).\n\nThe index itself is left as it is."},
   {"get_nns_by_item",(PyCFunction)py_an_get_nns_by_item, METH_VARARGS | METH_KEYWORDS, "Returns the `n` closest items to item `i`.\n\n:param search_k: the query will inspect up to `search_k` nodes.\n`search_k` gives you a run-time tradeoff between better accuracy and speed.\n`search_k` defaults to `n_trees * n` if not provided.\n\n:param include_distances: If `True`, this function will return a\n2 element tuple of lists. The first list contains the `n` closest items.\nThe second list contains the corresponding distances."},
   {"get_nns_by_vector",(PyCFunction)py_an_get_nns_by_vector, METH_VARARGS | METH_KEYWORDS, "Returns the `n` closest items to vector `vector`.\n\n:param search_k: the query will inspect up to `search_k` nodes.\n`search_k` gives you a run-time tradeoff between better accuracy and speed.\n`search_k` defaults to `n_trees * n` if not provided.\n\n:param include_distances: If `True`, this function will return a\n2 element tuple of lists. The first list contains the `n` closest items.\nThe second list contains the corresponding distances."},
-  {"get_item_vector",(PyCFunction)py_an_get_item_vector, METH_VARARGS, "Returns the vector for item `i` that was previously added."},
-  {"add_item",(PyCFunction)py_an_add_item, METH_VARARGS | METH_KEYWORDS, "Adds item `i` (any nonnegative integer) with vector `v`.\n\nNote that it will allocate memory for `max(i)+1` items."},
-  {"on_disk_build",(PyCFunction)py_an_on_disk_build, METH_VARARGS | METH_KEYWORDS, "Build will be performed with storage on disk instead of RAM."},
-  {"build",(PyCFunction)py_an_build, METH_VARARGS | METH_KEYWORDS, "Builds a forest of `n_trees` trees.\n\nMore trees give higher precision when querying. After calling `build`,\nno more items can be added. `n_jobs` specifies the number of threads used to build the trees. `n_jobs=-1` uses all available CPU cores."},
+  {"get_nns_by_vector_batch",(PyCFunction)py_an_get_nns_by_vector_batch, METH_VARARGS | METH_KEYWORDS, "Returns the `n` closest items to each row of `vectors`, a float32 array of shape (n_queries, f).\n\nThe queries run on `n_jobs` threads (`-1` uses all CPU cores) without holding the GIL.\nThe result is a memoryview of int32 ids with shape (n_queries, n), which `numpy.asarray` wraps\nwithout copying. Rows with fewer than `n` results are padded with `-1`.\n\n:param include_distances: If `True`, returns a tuple with the ids and a memoryview of float32\ndistances with the same shape, padded with NaN."},
+  {"get_item_vector",(PyCFunction)py_an_get_item_vector, METH_VARARGS | METH_KEYWORDS, "Returns the vector for item `i` that was previously added.\n\nWith `as_memoryview=True`, it is returned as a memoryview of floats instead of a list.\nFor `hamming` indexes, `packed=True` returns the bits packed into bytes, see `add_item`."},
+  {"get_item_vectors",(PyCFunction)py_an_get_item_vectors, METH_NOARGS, "Returns a read-only memoryview of the vectors of all items, with one row per item id.\n\nIt points into the index (for a loaded index, into the mmapped file), so nothing is copied, and\n`numpy.asarray` wraps it without copying either. Ids without items have zeros or stale vectors.\nThe index can't be changed, saved, loaded or unloaded while views of it exist, nor viewed while\nit is being changed. Not available for `hamming`."},
+  {"add_item",(PyCFunction)py_an_add_item, METH_VARARGS | METH_KEYWORDS, "Adds item `i` (any nonnegative integer) with vector `v`.\n\nNote that it will allocate memory for `max(i)+1` items.\n\nFor `hamming` indexes, `v` can also be packed, here and in queries: `bytes` or a uint8 array\nof `(f + 7) // 8` bytes, like `numpy.packbits(v, bitorder=\"little\")`, or a uint64 array of\n`(f + 63) // 64` words."},
+  {"add_items",(PyCFunction)py_an_add_items, METH_VARARGS | METH_KEYWORDS, "Adds the items `ids` with the vectors in the rows of `vectors`.\n\n`vectors` must be a C-contiguous float32 array (or other buffer) of shape `(len(ids), f)`.\nIt is read without copying, and the rows are added using `n_jobs` threads.\n`n_jobs=-1` uses all available CPU cores."},
+  {"add_items_from_file",(PyCFunction)py_an_add_items_from_file, METH_VARARGS | METH_KEYWORDS, "Adds the float32 vectors in the file `fn` as the items following the existing ones.\n\n:param format: `npy`, `fvecs` or `raw` (row-major floats). By default, it is picked from\nthe file extension, falling back to `raw`.\n\nThe file is mmapped and the vectors are copied using `n_jobs` threads."},
+  {"on_disk_build",(PyCFunction)py_an_on_disk_build, METH_VARARGS | METH_KEYWORDS, "Build will be performed with storage on disk instead of RAM.\n\nA loaded index is copied to the file instead, so that `add_trees`, `merge_trees` etc. change it there."},
+  {"build",(PyCFunction)py_an_build, METH_VARARGS | METH_KEYWORDS, "Builds a forest of `n_trees` trees.\n\nMore trees give higher precision when querying. After calling `build`,\nno more items can be added. `n_jobs` specifies the number of threads used to build the trees. `n_jobs=-1` uses all available CPU cores.\n\n:param memory_budget: If set (together with `n_trees=-1`), builds as many trees as fit\nin an index of at most `memory_budget` bytes."},
+  {"add_trees",(PyCFunction)py_an_add_trees, METH_VARARGS | METH_KEYWORDS, "Adds `n_trees` trees to a built or loaded index, using `n_jobs` threads.\n\nA loaded index is copied into memory, so save it again to keep the new trees."},
+  {"insert_item",(PyCFunction)py_an_insert_item, METH_VARARGS | METH_KEYWORDS, "Inserts item `i` with vector `v` into a built or loaded index, without rebuilding it.\n\nThe item goes into the leaf it falls into in each tree, and leaves that get too large are split.\nA loaded index is copied into memory, so save it again to keep the new items."},
+  {"mark_deleted",(PyCFunction)py_an_mark_deleted, METH_VARARGS, "Deletes item `i`, which queries no longer return.\n\nThe item stays in the trees until `compact` is called. A loaded index is copied into memory,\nso save it again to keep the deletion."},
+  {"compact",(PyCFunction)py_an_compact, METH_NOARGS, "Removes the deleted items from the trees, and merges the subtrees that are left with few items."},
+  {"merge",(PyCFunction)py_an_merge, METH_VARARGS, "Adds the items and trees of the built or loaded indexes passed as arguments to this one.\n\nThe indexes must have the same metric and number of dimensions, and no item ids in common.\nThe trees are copied as they are, so the number of trees adds up.\nA loaded index is copied into memory, so save it again to keep the merged items."},
+  {"merge_trees",(PyCFunction)py_an_merge_trees, METH_VARARGS, "Adds the trees of the built or loaded indexes passed as arguments to this one.\n\nThe indexes must have the same metric, number of dimensions and items, for instance because\nthey were built from the same vectors with other seeds. Only the trees are copied.\nA loaded index is copied into memory, so save it again to keep the merged trees."},
   {"unbuild",(PyCFunction)py_an_unbuild, METH_NOARGS, "Unbuilds the tree in order to allows adding new items.\n\nbuild() has to be called again afterwards in order to\nrun queries."},
   {"unload",(PyCFunction)py_an_unload, METH_NOARGS, "Unloads an index from disk."},
   {"get_distance",(PyCFunction)py_an_get_distance, METH_VARARGS, "Returns the distance between items `i` and `j`."},
   {"get_n_items",(PyCFunction)py_an_get_n_items, METH_NOARGS, "Returns the number of items in the index."},
   {"get_n_trees",(PyCFunction)py_an_get_n_trees, METH_NOARGS, "Returns the number of trees in the index."},
+  {"get_max_leaf_size",(PyCFunction)py_an_get_max_leaf_size, METH_NOARGS, "Returns the most items a leaf of the trees can have.\n\nLoaded indexes return the leaf size they were built with."},
+  {"get_memory_usage",(PyCFunction)py_an_get_memory_usage, METH_NOARGS, "Returns a dict with the number of bytes used by item vectors, split nodes,\nleaf buckets, root copies and unused allocated space (slack)."},
+  {"get_tree_stats",(PyCFunction)py_an_get_tree_stats, METH_VARARGS, "Returns a dict describing the shape of tree number `tree`.\n\nIt has the number of split nodes and leaves, the leaves by depth and by size,\nthe split nodes by imbalance in 10 bins from 0.5 to 1, the mean imbalance, and\nthe number of random splits, where no hyperplane was found during the build."},
+  {"get_candidate_stats",(PyCFunction)py_an_get_candidate_stats, METH_VARARGS | METH_KEYWORDS, "Queries with `n_queries` items spread over the index, and returns a dict\nwith the number of candidates the trees returned, how many were unique,\nand the share of duplicates."},
   {"verbose",(PyCFunction)py_an_verbose, METH_VARARGS, ""},
   {"set_seed",(PyCFunction)py_an_set_seed, METH_VARARGS, "Sets the seed of Annoy's random number generator."},
+  {"set_out_of_core_memory",(PyCFunction)py_an_set_out_of_core_memory, METH_VARARGS, "Builds indexes that don't fit in memory (see `on_disk_build`) using `memory` bytes for item vectors.\n\nLarge nodes are split using samples, and their items are read in the order they are stored in.\nSubtrees whose items fit in `memory` (divided among the `n_jobs` threads) are built from a copy\nof their items. `0` (the default) turns this off."},
+  {"set_projection",(PyCFunction)py_an_set_projection, METH_VARARGS, "Makes `build` learn the `n_components` directions in which the items vary most\n(their principal components), and split the items by their projections onto them.\n\nQueries go down the trees with the projected query, but rank the candidates by\ntheir full vectors. The projection is saved with the index. `0` (the default)\nsplits the item vectors."},
+  {"get_projection",(PyCFunction)py_an_get_projection, METH_NOARGS, "Returns the components of the projection of a built or loaded index, as a list\nof vectors, or an empty list if it has none."},
+  {"set_deterministic_build",(PyCFunction)py_an_set_deterministic_build, METH_VARARGS, "Makes `build` and `add_trees` give the same index, byte for byte, for the same seed and items,\nwith any `n_jobs`.\n\nThe trees differ from those of builds that aren't deterministic."},
+  {"set_build_callback",(PyCFunction)py_an_set_build_callback, METH_VARARGS, "Calls `callback` with the progress of the build after every tree, and at most once a second in between.\n\nThe progress is a dict with `n_trees`, `n_trees_total` (0 for `n_trees=-1`), `n_nodes`, `elapsed`\nand `eta` (in seconds, -1 if unknown). If `callback` returns `False` or raises, the build is cancelled.\n`None` removes the callback."},
+  {"cancel_build",(PyCFunction)py_an_cancel_build, METH_NOARGS, "Cancels the build that is running in another thread, if any.\n\nThe cancelled build raises an exception and leaves the index as it was before."},
+  {"set_split_sample_size",(PyCFunction)py_an_set_split_sample_size, METH_VARARGS, "Finds the splits of nodes with more than `n` items using a random sample of `n` items.\n\nAll items are then assigned to a side in a single pass. `0` (the default) uses all items."},
   {NULL, NULL, 0, NULL}		 /* Sentinel */
 };
 
 
+static PyBufferProcs py_annoy_as_buffer = {
+#ifndef IS_PY3K
+  0,                      /* bf_getreadbuffer */
+  0,                      /* bf_getwritebuffer */
+  0,                      /* bf_getsegcount */
+  0,                      /* bf_getcharbuffer */
+#endif
+  (getbufferproc)py_an_getbuffer,         /* bf_getbuffer */
+  (releasebufferproc)py_an_releasebuffer, /* bf_releasebuffer */
+};
+
+
 static PyTypeObject PyAnnoyType = {
   PyVarObject_HEAD_INIT(NULL, 0)
   "annoy.Annoy",          /*tp_name*/
@@ -611,11 +1756,11 @@ static PyTypeObject PyAnnoyType = {
   0,                      /*tp_str*/
   0,                      /*tp_getattro*/
   0,                      /*tp_setattro*/
-  0,                      /*tp_as_buffer*/
-  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /*tp_flags*/
+  &py_annoy_as_buffer,    /*tp_as_buffer*/
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE | Py_TPFLAGS_HAVE_GC, /*tp_flags*/
   ANNOY_DOC,              /* tp_doc */
-  0,                      /* tp_traverse */
-  0,                      /* tp_clear */
+  (traverseproc)py_an_traverse, /* tp_traverse */
+  (inquiry)py_an_clear,   /* tp_clear */
   0,                      /* tp_richcompare */
   0,                      /* tp_weaklistoffset */
   0,                      /* tp_iter */
@@ -219,6 +219,41 @@ func (suite *AnnoyTestSuite) TestGetNnsByItem() {
 	annoy.DeleteAnnoyIndexAngular(index)
 }
 
+func (suite *AnnoyTestSuite) TestGetNnsInto() {
+	t := suite.T()
+	index := annoy.NewAnnoyIndexAngular(3)
+	index.AddItem(0, []float32{0, 0, 1})
+	index.AddItem(1, []float32{0, 1, 0})
+	index.AddItem(2, []float32{1, 0, 0})
+	index.Build(10)
+
+	ids := make([]int32, 5)
+	distances := make([]float32, 5)
+	n := index.GetNnsByVectorInto([]float32{3, 2, 1}, -1, ids, distances)
+	assert.Equal(t, 3, n)
+	assert.Equal(t, []int32{2, 1, 0}, ids[:n])
+	assert.Equal(t, int32(-1), ids[3])
+
+	n = index.GetNnsByItemInto(1, -1, ids[:2], nil)
+	assert.Equal(t, 2, n)
+	assert.Equal(t, []int32{1, 0}, ids[:n])
+	n = index.GetNnsByItemInto(1, -1, ids, distances)
+	assert.InDelta(t, 0, distances[0], 0.00001)
+
+	batchIds := make([]int32, 6)
+	batchDistances := make([]float32, 6)
+	assert.True(t, index.GetNnsByVectors([]float32{3, 2, 1, 1, 2, 3}, 3, -1, batchIds, batchDistances))
+	assert.Equal(t, []int32{2, 1, 0, 0, 1, 2}, batchIds)
+	assert.False(t, index.GetNnsByVectors([]float32{3, 2, 1, 1, 2, 3}, 3, -1, batchIds[:5], nil))
+
+	item := make([]float32, 3)
+	assert.True(t, index.GetItemInto(2, item))
+	assert.Equal(t, []float32{1, 0, 0}, item)
+	assert.False(t, index.GetItemInto(2, item[:2]))
+
+	annoy.DeleteAnnoyIndexAngular(index)
+}
+
 func (suite *AnnoyTestSuite) TestGetItem() {
 	index := annoy.NewAnnoyIndexAngular(3)
 	index.AddItem(0, []float32{2, 1, 0})
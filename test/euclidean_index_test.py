@@ -74,12 +74,13 @@ def test_large_index():
         assert i.get_nns_by_item(j + 1, 2) == [j + 1, j]
 
 
-def precision(n, n_trees=10, n_points=10000, n_rounds=10):
+def precision(n, n_trees=10, n_points=10000, n_rounds=10, split_sample_size=0):
     found = 0
     for r in range(n_rounds):
         # create random points at distance x
         f = 10
         i = AnnoyIndex(f, "euclidean")
+        i.set_split_sample_size(split_sample_size)
         for j in range(n_points):
             p = [random.gauss(0, 1) for z in range(f)]
             norm = sum([pi**2 for pi in p]) ** 0.5
@@ -112,6 +113,10 @@ def test_precision_1000():
     assert precision(1000) >= 0.98
 
 
+def test_precision_with_split_sample():
+    assert precision(100, split_sample_size=500) >= 0.98
+
+
 def test_get_nns_with_distances():
     f = 3
     i = AnnoyIndex(f, "euclidean")
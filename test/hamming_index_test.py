@@ -121,3 +121,61 @@ def test_zero_vectors():
     js, ds = idx.get_nns_by_item(0, 5, include_distances=True)
     assert js[0] == 0
     assert ds[:4] == [0, 1, 1, 22]
+
+
+def test_balanced_splits():
+    # Most bits are rare, so splits on random bits would be very lopsided
+    f = 512
+    p = numpy.full(f, 0.02)
+    p[::64] = 0.5
+    i = AnnoyIndex(f, "hamming")
+    for j in range(5000):
+        i.add_item(j, numpy.random.binomial(1, p))
+    i.build(5)
+    for t in range(5):
+        stats = i.get_tree_stats(t)
+        assert stats["mean_imbalance"] < 0.8
+        assert len(stats["depths"]) < 20
+    for j in range(100):
+        assert i.get_distance(j, i.get_nns_by_item(j, 1)[0]) == 0
+
+
+def test_packed_vectors():
+    f = 100
+    bits = numpy.random.rand(500, f) > 0.5
+    packed = numpy.packbits(bits, axis=1, bitorder="little")
+    words = numpy.zeros((500, 2), dtype=numpy.uint64)
+    words.view(numpy.uint8)[:, : packed.shape[1]] = packed
+    i = AnnoyIndex(f, "hamming")
+    for j in range(500):
+        i.add_item(j, [packed[j].tobytes(), packed[j], words[j]][j % 3])
+    i.build(10)
+    for j in range(500):
+        assert i.get_item_vector(j) == bits[j].tolist()
+        assert i.get_item_vector(j, packed=True) == packed[j].tobytes()
+
+    ids, distances = i.get_nns_by_vector(packed[7], 5, include_distances=True)
+    assert (ids, distances) == i.get_nns_by_vector(bits[7].astype(numpy.float32), 5, include_distances=True)
+    assert ids[0] == 7 and distances[0] == 0
+    assert i.get_nns_by_vector(words[7], 5) == ids
+    batch = numpy.asarray(i.get_nns_by_vector_batch(packed[:20], 5))
+    assert numpy.array_equal(batch, numpy.asarray(i.get_nns_by_vector_batch(bits[:20].astype(numpy.float32), 5)))
+
+
+def test_add_items_from_file(tmp_path):
+    # More rows than are packed at a time, after an existing item
+    fn = str(tmp_path / "vectors.npy")
+    f, n = 72, 150000
+    bits = numpy.random.rand(n, f) > 0.5
+    numpy.save(fn, bits.astype(numpy.float32))
+    i = AnnoyIndex(f, "hamming")
+    i.add_item(0, bits[0])
+    i.add_items_from_file(fn)
+    assert i.get_n_items() == n + 1
+    for j in range(0, n, 997):
+        assert i.get_item_vector(j + 1) == bits[j].tolist()
+    assert i.get_item_vector(n) == bits[n - 1].tolist()
+    i.build(2)
+    i.save(str(tmp_path / "test.ann"))
+    with pytest.raises(IOError):
+        i.add_items_from_file(fn)
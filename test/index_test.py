@@ -12,9 +12,13 @@
 # License for the specific language governing permissions and limitations under
 # the License.
 
+import gc
 import os
 import random
+import threading
+import weakref
 
+import numpy
 import pytest
 
 from annoy import AnnoyIndex
@@ -146,12 +150,147 @@ def test_item_vector_after_save():
     assert set(a.get_nns_by_item(1, 999)) == set([1, 2, 3])
 
 
+def test_memoryview_results():
+    f = 10
+    i = AnnoyIndex(f, "euclidean")
+    for j in range(1000):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    i.build(10)
+    ids, distances = i.get_nns_by_item(0, 100, include_distances=True, as_memoryview=True)
+    assert (ids.format, distances.format) == ("i", "f")
+    assert ids.tolist() == i.get_nns_by_item(0, 100)
+    assert numpy.allclose(numpy.asarray(distances), i.get_nns_by_item(0, 100, include_distances=True)[1])
+    v = i.get_item_vector(5, as_memoryview=True)
+    assert i.get_nns_by_vector(v, 10, as_memoryview=True).tolist() == i.get_nns_by_vector(v, 10)
+    assert numpy.allclose(numpy.asarray(v), i.get_item_vector(5))
+
+
+def test_get_nns_by_vector_batch():
+    f = 10
+    i = AnnoyIndex(f, "euclidean")
+    for j in range(1000):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    i.build(10)
+    queries = numpy.random.randn(100, f).astype(numpy.float32)
+    ids, distances = i.get_nns_by_vector_batch(queries, 10, include_distances=True, n_jobs=2)
+    ids, distances = numpy.asarray(ids), numpy.asarray(distances)
+    assert ids.shape == distances.shape == (100, 10)
+    for q in range(100):
+        expected_ids, expected_distances = i.get_nns_by_vector(queries[q], 10, include_distances=True)
+        assert ids[q].tolist() == expected_ids
+        assert numpy.allclose(distances[q], expected_distances)
+    assert numpy.array_equal(numpy.asarray(i.get_nns_by_vector_batch(queries, 10, n_jobs=1)), ids)
+
+    # Padded when there are fewer items than n
+    ids = numpy.asarray(i.get_nns_by_vector_batch(queries[:3], 1001, search_k=100000))
+    assert (ids[:, -1] == -1).all()
+    with pytest.raises(ValueError):
+        i.get_nns_by_vector_batch(queries.astype(numpy.float64), 10)
+
+
+def test_item_vectors_view(tmp_path):
+    f = 10
+    vectors = numpy.random.randn(1000, f).astype(numpy.float32)
+    i = AnnoyIndex(f, "angular")
+    for j in range(1000):
+        i.add_item(j, vectors[j])
+    i.build(10)
+    i.save(str(tmp_path / "test.ann"))
+    view = i.get_item_vectors()
+    array = numpy.asarray(view)
+    assert array.shape == (1000, f)
+    assert not array.flags.writeable
+    assert numpy.array_equal(array, vectors)
+    with pytest.raises(BufferError):
+        i.unload()
+    with pytest.raises(BufferError):
+        i.add_trees(1)
+    with pytest.raises(BufferError):
+        i.unbuild()
+    del array
+    view.release()
+    i.unload()
+    with pytest.raises(BufferError):
+        AnnoyIndex(f, "hamming").get_item_vectors()
+
+
+def test_item_vectors_view_while_changing():
+    f = 10
+    i = AnnoyIndex(f, "angular")
+    i.add_items(list(range(1000)), numpy.random.randn(1000, f).astype(numpy.float32))
+    # The build callback runs in the middle of the build, when no views can be taken nor changes made
+    errors = []
+
+    def callback(progress):
+        for call in [i.get_item_vectors, lambda: i.add_trees(1), i.unbuild, i.unload]:
+            try:
+                call()
+            except (BufferError, RuntimeError) as e:
+                errors.append(type(e))
+
+    i.set_build_callback(callback)
+    i.build(2, n_jobs=1)
+    i.set_build_callback(None)
+    assert errors[:4] == [BufferError, RuntimeError, RuntimeError, RuntimeError]
+    assert i.get_n_trees() == 2
+    assert numpy.asarray(i.get_item_vectors()).shape == (1000, f)
+    # Nor can the index be changed by vectors viewed from itself
+    i.unbuild()
+    with pytest.raises(BufferError):
+        i.add_items(list(range(1000, 2000)), i)
+    assert i.get_n_items() == 1000
+
+
 def test_prefault():
     i = AnnoyIndex(10, "angular")
     i.load("test/test.tree", prefault=True)
     assert i.get_nns_by_item(0, 10) == [0, 85, 42, 11, 54, 38, 53, 66, 19, 31]
 
 
+def test_prefault_async():
+    i = AnnoyIndex(10, "angular")
+    i.load("test/test.tree")
+    i.prefault_async(n_jobs=4)
+    # Queries can run while the index is being prefaulted
+    assert i.get_nns_by_item(0, 10) == [0, 85, 42, 11, 54, 38, 53, 66, 19, 31]
+    i.wait_prefault()
+    assert i.get_prefault_progress() == 1.0
+    assert i.get_nns_by_item(0, 10) == [0, 85, 42, 11, 54, 38, 53, 66, 19, 31]
+
+
+def test_unload_during_prefault_async():
+    i = AnnoyIndex(10, "angular")
+    for x in range(100):
+        i.load("test/test.tree")
+        i.prefault_async()
+        i.unload()
+
+
+def test_prefault_async_threads():
+    # wait_prefault releases the GIL, so other threads can restart or stop the prefaulting meanwhile
+    i = AnnoyIndex(10, "angular")
+    i.load("test/test.tree")
+    done = threading.Event()
+
+    def wait():
+        while not done.is_set():
+            i.wait_prefault()
+
+    threads = [threading.Thread(target=wait) for _ in range(2)]
+    for thread in threads:
+        thread.start()
+    for x in range(100):
+        i.prefault_async(n_jobs=2)
+        if x % 10 == 0:
+            i.unload()
+            i.load("test/test.tree")
+    done.set()
+    for thread in threads:
+        thread.join()
+    i.wait_prefault()
+    assert i.get_nns_by_item(0, 10) == [0, 85, 42, 11, 54, 38, 53, 66, 19, 31]
+
+
 def test_fail_save():
     t = AnnoyIndex(40, "angular")
     with pytest.raises(IOError):
@@ -197,6 +336,76 @@ def test_get_n_trees():
     assert i.get_n_trees() == 10
 
 
+def test_get_memory_usage(tmp_path):
+    fn = str(tmp_path / "test.annoy")
+    f = 10
+    t = AnnoyIndex(f, "angular")
+    for i in range(1000):
+        t.add_item(i, [random.gauss(0, 1) for z in range(f)])
+    t.build(10)
+    t.save(fn)
+    usage = t.get_memory_usage()
+    assert usage["item_vectors"] > 0
+    assert usage["split_nodes"] > 0
+    assert usage["leaf_buckets"] > 0
+    assert usage["root_copies"] > 0
+    assert usage["slack"] == 0
+    assert usage["total"] == os.path.getsize(fn)
+    assert usage["total"] == sum(v for k, v in usage.items() if k != "total")
+
+
+def test_build_with_memory_budget(tmp_path):
+    fn = str(tmp_path / "test.annoy")
+    f = 10
+    # Large leaves keep their items in buckets, which count too
+    for max_leaf_size in [0, 100]:
+        t = AnnoyIndex(f, "angular", max_leaf_size=max_leaf_size)
+        for i in range(1000):
+            t.add_item(i, [random.gauss(0, 1) for z in range(f)])
+        memory_budget = 100000
+        t.build(-1, memory_budget=memory_budget)
+        t.save(fn)
+        assert os.path.getsize(fn) <= memory_budget
+        n_trees = t.get_n_trees()
+        assert n_trees > 1
+
+        # One more tree should not fit
+        node_size = t.get_memory_usage()["item_vectors"] // 1000
+        tree_size = (os.path.getsize(fn) - 1000 * node_size) // n_trees
+        assert os.path.getsize(fn) + tree_size > memory_budget * 0.9
+
+
+def test_build_with_too_small_memory_budget():
+    f = 10
+    t = AnnoyIndex(f, "angular")
+    for i in range(1000):
+        t.add_item(i, [random.gauss(0, 1) for z in range(f)])
+    with pytest.raises(Exception):
+        t.build(-1, memory_budget=1000)
+    with pytest.raises(ValueError):
+        t.build(10, memory_budget=100000)
+
+
+def test_build_with_memory_budget_distinct_trees(tmp_path):
+    # Each round of the build seeds its trees differently, so that it doesn't repeat the trees of the first round
+    f = 10
+    t = AnnoyIndex(f, "angular")
+    for i in range(1000):
+        t.add_item(i, [random.gauss(0, 1) for z in range(f)])
+    t.build(-1, memory_budget=200000)
+    fn = str(tmp_path / "test.annoy")
+    t.save(fn)
+    n_trees = t.get_n_trees()
+    assert n_trees > 3
+
+    # The copies of the roots are the last nodes of the file, and end with the hyperplane of their split
+    node_size = t.get_memory_usage()["item_vectors"] // 1000
+    with open(fn, "rb") as fh:
+        data = fh.read()
+    planes = set(data[len(data) - k * node_size - 4 * f:len(data) - k * node_size] for k in range(n_trees))
+    assert len(planes) == n_trees
+
+
 def test_write_failed():
     f = 40
 
@@ -216,6 +425,118 @@ def test_write_failed():
         t.save(path)
 
 
+def test_save_without_reload(tmp_path):
+    fn = str(tmp_path / "test.annoy")
+    f = 10
+    t = AnnoyIndex(f, "angular")
+    for i in range(1000):
+        t.add_item(i, [random.gauss(0, 1) for z in range(f)])
+    t.build(10)
+    expected = t.get_nns_by_item(0, 100)
+    t.save(fn, reload=False)
+    assert t.get_nns_by_item(0, 100) == expected
+    t.save(fn, reload=False)  # The in-memory index can be saved again
+
+    u = AnnoyIndex(f, "angular")
+    u.load(fn)
+    assert u.get_nns_by_item(0, 100) == expected
+
+
+def test_save_atomic(tmp_path):
+    fn = str(tmp_path / "test.annoy")
+    f = 10
+    t = AnnoyIndex(f, "angular")
+    for i in range(1000):
+        t.add_item(i, [random.gauss(0, 1) for z in range(f)])
+    t.build(10)
+    expected = t.get_nns_by_item(0, 100)
+    t.save(fn, atomic=True)
+    assert t.get_nns_by_item(0, 100) == expected
+    assert os.listdir(str(tmp_path)) == ["test.annoy"]
+
+    u = AnnoyIndex(f, "angular")
+    u.load(fn)
+    assert u.get_nns_by_item(0, 100) == expected
+
+
+def test_save_atomic_threads(tmp_path):
+    # Threads saving to the same path must not share a temporary file
+    f = 10
+    indexes = []
+    for n_trees in [5, 10]:
+        t = AnnoyIndex(f, "angular")
+        for i in range(1000):
+            t.add_item(i, [random.gauss(0, 1) for z in range(f)])
+        t.build(n_trees)
+        indexes.append(t)
+    fn = str(tmp_path / "test.annoy")
+
+    def save(t):
+        for _ in range(20):
+            t.save(fn, reload=False, atomic=True)
+
+    threads = [threading.Thread(target=save, args=(t,)) for t in indexes]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    assert os.listdir(str(tmp_path)) == ["test.annoy"]
+
+    u = AnnoyIndex(f, "angular")
+    u.load(fn)
+    t = indexes[u.get_n_trees() == 10]
+    assert u.get_n_trees() == t.get_n_trees()
+    assert u.get_nns_by_item(0, 100) == t.get_nns_by_item(0, 100)
+
+
+def test_save_to_fd(tmp_path):
+    fn = str(tmp_path / "test.annoy")
+    f = 10
+    t = AnnoyIndex(f, "angular")
+    for i in range(1000):
+        t.add_item(i, [random.gauss(0, 1) for z in range(f)])
+    t.build(10)
+    expected = t.get_nns_by_item(0, 100)
+
+    # Stream the index through a pipe, which only accepts a limited amount of data at a time
+    r, w = os.pipe()
+    chunks = []
+    reader = threading.Thread(target=lambda: chunks.extend(iter(lambda: os.read(r, 1 << 16), b"")))
+    reader.start()
+    t.save_to_fd(w)
+    os.close(w)
+    reader.join()
+    os.close(r)
+    assert t.get_nns_by_item(0, 100) == expected
+
+    with open(fn, "wb") as fobj:
+        fobj.write(b"".join(chunks))
+    u = AnnoyIndex(f, "angular")
+    u.load(fn)
+    assert u.get_nns_by_item(0, 100) == expected
+
+    # The nodes can't change while they're written out, nor be written out while they change
+    view = t.get_item_vectors()
+    with pytest.raises(BufferError):
+        t.save_to_fd(w)
+    with pytest.raises(BufferError):
+        t.save(fn, reload=False)
+    view.release()
+    errors = []
+
+    def callback(progress):
+        for call in [lambda: t.save_to_fd(-1), lambda: t.save(fn, reload=False)]:
+            try:
+                call()
+            except RuntimeError as e:
+                errors.append(e)
+
+    t.unbuild()
+    t.set_build_callback(callback)
+    t.build(2, n_jobs=1)
+    assert len(errors) >= 2
+
+
 def test_dimension_mismatch():
     t = AnnoyIndex(100, "angular")
     for i in range(1000):
@@ -277,3 +598,563 @@ def test_very_large_index():
 
     # Sanity check number of trees
     assert m.get_n_trees() == n_trees
+
+
+def test_split_sample_size():
+    f = 10
+    i = AnnoyIndex(f, "euclidean")
+    i.set_split_sample_size(100)
+    for j in range(10000):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    i.build(10)
+    for j in range(0, 10000, 100):
+        assert i.get_nns_by_item(j, 1)[0] == j
+
+    for n in [-1, 1]:
+        with pytest.raises(ValueError):
+            i.set_split_sample_size(n)
+
+
+def test_add_items():
+    f, n = 10, 1000
+    vectors = numpy.random.normal(size=(n, f)).astype(numpy.float32)
+    i = AnnoyIndex(f, "euclidean")
+    i.add_items(numpy.arange(n)[::-1], vectors, n_jobs=4)
+    assert i.get_n_items() == n
+    for j in range(0, n, 100):
+        assert i.get_item_vector(n - 1 - j) == pytest.approx(vectors[j].tolist())
+
+    # ids can also be a plain list
+    i = AnnoyIndex(f, "euclidean")
+    i.add_items(list(range(n)), vectors)
+    i.build(10)
+    for j in range(0, n, 100):
+        assert i.get_nns_by_item(j, 1)[0] == j
+
+
+def test_add_items_errors():
+    f = 10
+    i = AnnoyIndex(f, "euclidean")
+    vectors = numpy.zeros((2, f), dtype=numpy.float32)
+    with pytest.raises(ValueError):
+        i.add_items([0, 1], vectors.astype(numpy.float64))
+    with pytest.raises(ValueError):
+        i.add_items([0, 1], numpy.zeros((2, f + 1), dtype=numpy.float32))
+    with pytest.raises(ValueError):
+        i.add_items([0], vectors)
+    with pytest.raises(IndexError):
+        i.add_items([0, -1], vectors)
+    with pytest.raises(Exception):
+        i.add_items([1, 1], vectors)
+
+
+def test_add_items_from_file(tmp_path):
+    npy_fn = str(tmp_path / "vectors.npy")
+    raw_fn = str(tmp_path / "vectors.raw")
+    fvecs_fn = str(tmp_path / "vectors.fvecs")
+    f, n = 10, 1000
+    vectors = numpy.random.normal(size=(n, f)).astype(numpy.float32)
+    numpy.save(npy_fn, vectors)
+    vectors.tofile(raw_fn)
+    fvecs = numpy.hstack([numpy.full((n, 1), f, dtype=numpy.int32).view(numpy.float32), vectors])
+    fvecs.tofile(fvecs_fn)
+
+    for fn, format in [(npy_fn, "auto"), (fvecs_fn, "auto"), (raw_fn, "raw")]:
+        i = AnnoyIndex(f, "euclidean")
+        i.add_item(0, vectors[0])
+        i.add_items_from_file(fn, format=format)
+        # The vectors go after the existing items
+        assert i.get_n_items() == n + 1
+        for j in range(0, n, 100):
+            assert i.get_item_vector(j + 1) == pytest.approx(vectors[j].tolist())
+
+    i = AnnoyIndex(f + 1, "euclidean")
+    for fn in [npy_fn, fvecs_fn, raw_fn, str(tmp_path / "does_not_exist.npy")]:
+        with pytest.raises(IOError):
+            i.add_items_from_file(fn)
+    numpy.save(npy_fn, vectors.astype(numpy.float64))
+    with pytest.raises(IOError):
+        AnnoyIndex(f, "euclidean").add_items_from_file(npy_fn)
+    # Only 2-d arrays, even if their first dimensions fit
+    for shape in [(n, f, 2), (n * f,)]:
+        numpy.save(npy_fn, numpy.zeros(shape, dtype=numpy.float32))
+        with pytest.raises(IOError):
+            AnnoyIndex(f, "euclidean").add_items_from_file(npy_fn)
+
+    # An fvecs row in the middle with another dimension
+    fvecs[500, 0] = numpy.array([f + 1], dtype=numpy.int32).view(numpy.float32)[0]
+    fvecs.tofile(fvecs_fn)
+    with pytest.raises(IOError):
+        AnnoyIndex(f, "euclidean").add_items_from_file(fvecs_fn)
+
+
+def test_add_trees(tmp_path):
+    fn = str(tmp_path / "test.ann")
+    f = 10
+    i = AnnoyIndex(f, "angular")
+    for j in range(1000):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    i.build(5)
+    # An exhaustive search gives the same result with the new trees
+    nns = i.get_nns_by_item(0, 10, search_k=100000)
+    i.add_trees(3)
+    assert i.get_n_trees() == 8
+    assert i.get_nns_by_item(0, 10, search_k=100000) == nns
+
+    i.save(fn)
+    i.load(fn)
+    assert i.get_n_trees() == 8
+    i.add_trees(2, n_jobs=2)
+    assert i.get_n_trees() == 10
+    i.save(fn)
+
+    j = AnnoyIndex(f, "angular")
+    j.load(fn)
+    assert j.get_n_trees() == 10
+    for k in range(0, 1000, 50):
+        assert j.get_nns_by_item(k, 1)[0] == k
+
+
+def test_add_trees_to_unbuilt_index():
+    i = AnnoyIndex(10, "angular")
+    i.add_item(0, [random.gauss(0, 1) for z in range(10)])
+    with pytest.raises(Exception):
+        i.add_trees(1)
+
+
+def test_insert_item(tmp_path):
+    fn = str(tmp_path / "test.ann")
+    f = 10
+    i = AnnoyIndex(f, "euclidean")
+    for j in range(1000):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    i.build(10)
+    for j in range(1000, 3000):
+        i.insert_item(j, [random.gauss(0, 1) for z in range(f)])
+    assert i.get_n_items() == 3000
+    for k in range(0, 3000, 10):
+        assert i.get_nns_by_item(k, 1)[0] == k
+    with pytest.raises(Exception):
+        i.insert_item(5, [0] * f)
+
+    i.save(fn)
+    i.load(fn)
+    i.insert_item(5000, i.get_item_vector(0))
+    assert i.get_n_items() == 5001
+    assert i.get_nns_by_item(0, 2) in ([0, 5000], [5000, 0])
+    i.save(fn)
+
+    j = AnnoyIndex(f, "euclidean")
+    j.load(fn)
+    assert j.get_n_trees() == 10
+    assert j.get_n_items() == 5001
+    assert j.get_nns_by_item(5000, 2) in ([0, 5000], [5000, 0])
+
+
+def test_insert_item_into_buckets():
+    # Leaves that are too large for a node keep room for more items in their buckets, instead of
+    # copying the bucket for every item
+    f = 10
+    i = AnnoyIndex(f, "euclidean", max_leaf_size=100)
+    for j in range(1000):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    i.build(10)
+    for j in range(1000, 3000):
+        i.insert_item(j, [random.gauss(0, 1) for z in range(f)])
+    for k in range(0, 3000, 10):
+        assert i.get_nns_by_item(k, 1)[0] == k
+    assert i.get_memory_usage()["leaf_buckets"] < 3000 * 10 * 4 * 10
+
+
+def test_insert_item_into_small_index():
+    # The roots start out as leaves, and have to be split once there are enough items
+    f = 5
+    i = AnnoyIndex(f, "angular")
+    for j in range(3):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    i.build(3)
+    for j in range(3, 300):
+        i.insert_item(j, [random.gauss(0, 1) for z in range(f)])
+    assert i.get_n_trees() == 3
+    for k in range(300):
+        assert i.get_nns_by_item(k, 1)[0] == k
+
+
+def test_mark_deleted(tmp_path):
+    fn = str(tmp_path / "test.ann")
+    f = 10
+    i = AnnoyIndex(f, "euclidean")
+    for j in range(1000):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    i.build(10)
+    deleted = set(range(0, 1000, 2))
+    for j in deleted:
+        i.mark_deleted(j)
+    with pytest.raises(Exception):
+        i.mark_deleted(0)
+    for k in range(1, 1000, 10):
+        nns = i.get_nns_by_item(k, 10)
+        assert nns[0] == k
+        assert not deleted & set(nns)
+
+    i.save(fn)
+    j = AnnoyIndex(f, "euclidean")
+    j.load(fn)
+    assert not deleted & set(j.get_nns_by_item(1, 500, search_k=100000))
+    j.mark_deleted(1)
+    assert 1 not in j.get_nns_by_item(3, 500, search_k=100000)
+
+
+def test_mark_deleted_insert_again():
+    f = 10
+    i = AnnoyIndex(f, "euclidean")
+    for j in range(1000):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    i.build(10)
+    for j in range(0, 1000, 3):
+        i.mark_deleted(j)
+        i.insert_item(j, [random.gauss(0, 1) for z in range(f)])
+    # The items left their old leaves, so every tree has each of them once
+    for t in range(10):
+        stats = i.get_tree_stats(t)
+        assert sum(k * c for k, c in enumerate(stats["leaf_sizes"])) == 1000
+    for k in range(0, 1000, 3):
+        assert i.get_nns_by_item(k, 1)[0] == k
+    i.compact()
+    assert sorted(i.get_nns_by_item(0, 1000, search_k=100000)) == list(range(1000))
+
+
+def test_compact():
+    f = 10
+    i = AnnoyIndex(f, "euclidean")
+    for j in range(1000):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    i.build(10)
+    size = i.get_memory_usage()["split_nodes"]
+    for j in range(900):
+        i.mark_deleted(j)
+    i.compact()
+    assert i.get_n_trees() == 10
+    assert i.get_memory_usage()["split_nodes"] < size / 5
+    assert sorted(i.get_nns_by_item(900, 1000, search_k=100000)) == list(range(900, 1000))
+    for k in range(900, 1000):
+        assert i.get_nns_by_item(k, 1)[0] == k
+
+    # Every tree is down to its root once all items are gone
+    for j in range(900, 1000):
+        i.mark_deleted(j)
+    i.compact()
+    assert i.get_nns_by_vector([0] * f, 10) == []
+
+
+def test_merge(tmp_path):
+    fn = str(tmp_path / "test.ann")
+    f = 10
+    indexes = []
+    for k in range(3):
+        i = AnnoyIndex(f, "angular")
+        for j in range(k * 1000, (k + 1) * 1000):
+            i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+        i.build(5)
+        i.save(str(tmp_path / ("test%d.ann" % k)))
+        indexes.append(i)
+
+    i = indexes[0]
+    i.merge(indexes[1], indexes[2])
+    assert i.get_n_items() == 3000
+    assert i.get_n_trees() == 15
+    for k in range(0, 3000, 10):
+        assert i.get_nns_by_item(k, 1, search_k=1000)[0] == k
+        assert i.get_item_vector(k) == indexes[k // 1000].get_item_vector(k)
+    with pytest.raises(Exception):
+        i.merge(indexes[1])
+    with pytest.raises(Exception):
+        i.merge(AnnoyIndex(f, "euclidean"))
+
+    i.save(fn)
+    j = AnnoyIndex(f, "angular")
+    j.load(fn)
+    assert j.get_n_items() == 3000
+    assert j.get_n_trees() == 15
+    assert len(j.get_nns_by_item(0, 3000, search_k=100000)) == 3000
+
+
+def test_merge_loaded_indexes(tmp_path):
+    f = 10
+    for k in range(2):
+        i = AnnoyIndex(f, "euclidean")
+        for j in range(k * 100, (k + 1) * 100):
+            i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+        i.build(5)
+        i.save(str(tmp_path / ("test%d.ann" % k)))
+    i = AnnoyIndex(f, "euclidean")
+    i.load(str(tmp_path / "test0.ann"))
+    j = AnnoyIndex(f, "euclidean")
+    j.load(str(tmp_path / "test1.ann"))
+    i.merge(j)
+    assert i.get_n_trees() == 10
+    for k in range(200):
+        assert i.get_nns_by_item(k, 1, search_k=1000)[0] == k
+
+
+def test_merge_trees(tmp_path):
+    fn = str(tmp_path / "test.ann")
+    f = 10
+    vectors = [[random.gauss(0, 1) for z in range(f)] for j in range(1000)]
+    for k in range(3):
+        i = AnnoyIndex(f, "euclidean", max_leaf_size=50)
+        i.set_seed(k)
+        for j, v in enumerate(vectors):
+            i.add_item(j, v)
+        i.build(4)
+        i.save(str(tmp_path / ("test%d.ann" % k)))
+    indexes = []
+    for k in range(3):
+        i = AnnoyIndex(f, "euclidean", max_leaf_size=50)
+        i.load(str(tmp_path / ("test%d.ann" % k)))
+        indexes.append(i)
+
+    i = indexes[0]
+    i.merge_trees(indexes[1], indexes[2])
+    assert i.get_n_items() == 1000
+    assert i.get_n_trees() == 12
+    for k in range(1000):
+        assert i.get_nns_by_item(k, 1)[0] == k
+    i.save(fn)
+    j = AnnoyIndex(f, "euclidean", max_leaf_size=50)
+    j.load(fn)
+    assert j.get_n_trees() == 12
+    assert len(j.get_nns_by_item(0, 1000, search_k=100000)) == 1000
+
+    other = AnnoyIndex(f, "euclidean", max_leaf_size=50)
+    for j, v in enumerate(vectors[:-1]):
+        other.add_item(j, v)
+    other.build(2)
+    with pytest.raises(Exception, match="same items"):
+        i.merge_trees(other)
+
+
+def test_build_callback():
+    f = 10
+    i = AnnoyIndex(f, "angular")
+    for j in range(1000):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    progress = []
+    i.set_build_callback(progress.append)
+    i.build(10, n_jobs=2)
+    assert len(progress) == 10
+    assert progress[-1]["n_trees"] == progress[-1]["n_trees_total"] == 10
+    assert progress[-1]["n_nodes"] > 0
+    assert progress[-1]["eta"] == 0
+
+    i.set_build_callback(lambda p: p["n_trees"] < 2)
+    with pytest.raises(Exception):
+        i.add_trees(5)
+    assert i.get_n_trees() == 10
+    i.set_build_callback(None)
+    i.add_trees(5)
+    assert i.get_n_trees() == 15
+
+
+def test_cancel_build():
+    f = 10
+    i = AnnoyIndex(f, "angular")
+    for j in range(1000):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    # Without a build running, there is nothing to cancel
+    i.cancel_build()
+    i.build(10)
+    assert i.get_n_trees() == 10
+
+    i.set_build_callback(lambda progress: i.cancel_build())
+    with pytest.raises(Exception):
+        i.add_trees(10)
+    assert i.get_n_trees() == 10
+    i.set_build_callback(None)
+    i.add_trees(10)
+    assert i.get_n_trees() == 20
+    assert i.get_nns_by_item(0, 1)[0] == 0
+
+
+def test_build_callback_cycle():
+    # The callback refers to the index, which refers to the callback, so only the garbage collector frees them
+    class Callback(object):
+        def __call__(self, progress):
+            return self.index.get_n_items() > 0
+
+    callback = Callback()
+    callback.index = AnnoyIndex(10, "angular")
+    callback.index.set_build_callback(callback)
+    ref = weakref.ref(callback)
+    del callback
+    gc.collect()
+    assert ref() is None
+
+
+def test_max_leaf_size(tmp_path):
+    fn = str(tmp_path / "leaf_size.ann")
+    f = 10
+    vecs = [[random.gauss(0, 1) for z in range(f)] for j in range(1000)]
+    for max_leaf_size in [2, 100]:
+        i = AnnoyIndex(f, "euclidean", max_leaf_size=max_leaf_size)
+        for j in range(1000):
+            i.add_item(j, vecs[j])
+        i.build(10, n_jobs=2)
+        assert i.get_max_leaf_size() == max_leaf_size
+        i.save(fn)
+        j = AnnoyIndex(f, "euclidean")
+        j.load(fn)
+        assert j.get_max_leaf_size() == max_leaf_size
+        for k in range(0, 1000, 10):
+            assert j.get_nns_by_item(k, 10) == i.get_nns_by_item(k, 10)
+            assert j.get_nns_by_item(k, 1)[0] == k
+
+    i = AnnoyIndex(f, "euclidean")
+    assert i.get_max_leaf_size() > 2
+    with pytest.raises(ValueError):
+        AnnoyIndex(f, "euclidean", max_leaf_size=1)
+
+
+def test_max_leaf_size_modify():
+    f = 10
+    i = AnnoyIndex(f, "euclidean", max_leaf_size=50)
+    j = AnnoyIndex(f, "euclidean", max_leaf_size=50)
+    for k in range(400):
+        (i if k < 200 else j).add_item(k, [random.gauss(0, 1) for z in range(f)])
+    i.build(5)
+    j.build(5)
+    for k in range(400, 500):
+        i.insert_item(k, [random.gauss(0, 1) for z in range(f)])
+    ids = list(range(200)) + list(range(400, 500))
+    for k in ids[::2]:
+        i.mark_deleted(k)
+    i.compact()
+    i.merge(j)
+    other = AnnoyIndex(f, "euclidean")
+    other.add_item(1000, [random.gauss(0, 1) for z in range(f)])
+    other.build(5)
+    with pytest.raises(Exception, match="leaf size"):
+        i.merge(other)
+    for k in ids[1::2] + list(range(200, 400)):
+        assert i.get_nns_by_item(k, 1, search_k=10000)[0] == k
+
+
+def test_tree_stats():
+    f = 10
+    i = AnnoyIndex(f, "euclidean")
+    for j in range(1000):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    for j in range(1000, 2000):
+        i.add_item(j, [1] * f)
+    i.build(3)
+    for t in range(3):
+        stats = i.get_tree_stats(t)
+        assert stats["n_leaves"] == stats["n_split_nodes"] + 1
+        assert sum(k * c for k, c in enumerate(stats["leaf_sizes"])) == 2000
+        assert sum(stats["depths"]) == stats["n_leaves"]
+        assert sum(stats["imbalance"]) == stats["n_split_nodes"]
+        assert 0.5 <= stats["mean_imbalance"] <= 1
+        # The identical vectors can only be split at random
+        assert stats["n_random_splits"] > 0
+    with pytest.raises(IndexError):
+        i.get_tree_stats(3)
+
+    candidates = i.get_candidate_stats(n_queries=50, n=10)
+    assert candidates["n_queries"] == 50
+    assert candidates["n_candidates"] >= candidates["n_unique"] >= 10
+    assert 0 <= candidates["duplicate_rate"] < 1
+
+
+def test_stats_cli(capsys, tmp_path):
+    from annoy.__main__ import main
+    fn = str(tmp_path / "stats.ann")
+
+    f = 10
+    i = AnnoyIndex(f, "angular")
+    for j in range(1000):
+        i.add_item(j, [random.gauss(0, 1) for z in range(f)])
+    i.build(4)
+    i.save(fn)
+    main(["stats", fn, str(f), "angular"])
+    out = capsys.readouterr().out
+    assert out.startswith("1000 items, 4 trees")
+    assert "tree 3: " in out
+    assert "0 random splits" in out
+
+
+def test_build_cli(tmp_path):
+    from annoy.__main__ import main
+    npy_fn = str(tmp_path / "vectors.npy")
+    fn = str(tmp_path / "test.ann")
+
+    f = 10
+    vectors = numpy.random.randn(2000, f).astype(numpy.float32)
+    numpy.save(npy_fn, vectors)
+    # Large leaves put buckets into the shards, which the stitched index has to point to
+    for max_leaf_size in [0, 100]:
+        main(["build", npy_fn, fn, str(f), "angular", "--trees", "5", "--workers", "2", "--shards", "3",
+              "--max-leaf-size", str(max_leaf_size)])
+        assert sorted(os.listdir(str(tmp_path))) == ["test.ann", "vectors.npy"]
+        i = AnnoyIndex(f, "angular")
+        i.load(fn)
+        assert i.get_n_items() == 2000
+        assert i.get_n_trees() == 5
+        for k in range(0, 2000, 10):
+            assert i.get_nns_by_item(k, 1)[0] == k
+        i.unload()
+
+
+def test_build_cli_n_jobs(tmp_path):
+    # Each shard's threads use the seeds after the shard's own, which must not be the seeds of other shards
+    from annoy.__main__ import main
+    npy_fn = str(tmp_path / "vectors.npy")
+    fn = str(tmp_path / "test.ann")
+
+    f = 10
+    numpy.save(npy_fn, numpy.random.randn(2000, f).astype(numpy.float32))
+    main(["build", npy_fn, fn, str(f), "angular", "--trees", "6", "--workers", "1", "--shards", "3",
+          "--n-jobs", "2"])
+    i = AnnoyIndex(f, "angular")
+    i.load(fn)
+    n_trees = i.get_n_trees()
+    assert n_trees == 6
+
+    # The copies of the roots are the last nodes of the file, and end with the hyperplane of their split
+    node_size = i.get_memory_usage()["item_vectors"] // 2000
+    with open(fn, "rb") as fh:
+        data = fh.read()
+    planes = set(data[len(data) - k * node_size - 4 * f:len(data) - k * node_size] for k in range(n_trees))
+    assert len(planes) == n_trees
+
+
+def test_projection(tmp_path):
+    fn = str(tmp_path / "projection.ann")
+    f = 20
+    scales = [0.5**z for z in range(f)]
+    i = AnnoyIndex(f, "euclidean")
+    for j in range(2000):
+        i.add_item(j, [random.gauss(0, s) for s in scales])
+    i.set_projection(4)
+    i.build(10)
+    components = i.get_projection()
+    assert len(components) == 4
+    # Most of the variance is in the first dimension
+    assert abs(components[0][0]) > 0.9
+    for k in range(100):
+        assert i.get_nns_by_item(k, 1)[0] == k
+    i.insert_item(2000, [1] * f)
+    assert i.get_nns_by_vector([1] * f, 1)[0] == 2000
+
+    i.save(fn)
+    j = AnnoyIndex(f, "euclidean")
+    j.load(fn)
+    assert numpy.allclose(j.get_projection(), components)
+    for k in range(0, 2000, 20):
+        assert j.get_nns_by_item(k, 10) == i.get_nns_by_item(k, 10)
+
+    with pytest.raises(Exception):
+        j.set_projection(2)
+    with pytest.raises(Exception):
+        AnnoyIndex(f, "euclidean").set_projection(f + 1)
+    with pytest.raises(Exception):
+        AnnoyIndex(f, "hamming").set_projection(2)
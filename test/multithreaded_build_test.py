@@ -1,3 +1,5 @@
+import hashlib
+
 import numpy
 
 from annoy import AnnoyIndex
@@ -27,3 +29,64 @@ def test_four_threads():
 
 def test_eight_threads():
     _test_building_with_threads(8)
+
+
+def test_fewer_trees_than_threads():
+    # Large enough for subtrees and splits to be built by parallel tasks
+    n, f = 100000, 4
+    n_trees = 2
+    i = AnnoyIndex(f, "euclidean")
+    for j in range(n):
+        i.add_item(j, numpy.random.normal(size=f))
+    assert i.build(n_trees, n_jobs=8)
+    assert n_trees == i.get_n_trees()
+    for j in range(0, n, 1000):
+        assert i.get_nns_by_item(j, 1)[0] == j
+
+
+def test_on_disk_build_with_threads(tmp_path):
+    fn = str(tmp_path / "on_disk_threads.ann")
+    n, f = 10000, 10
+    i = AnnoyIndex(f, "euclidean")
+    i.on_disk_build(fn)
+    for j in range(n):
+        i.add_item(j, numpy.random.normal(size=f))
+    assert i.build(-1, n_jobs=4)
+    i.unload()
+    i.load(fn)
+    for j in range(0, n, 100):
+        assert i.get_nns_by_item(j, 1)[0] == j
+
+
+def test_load_after_building_with_threads(tmp_path):
+    # The roots of trees built by different threads are interleaved with the other nodes
+    fn = str(tmp_path / "threads.ann")
+    n, f = 10000, 10
+    n_trees = 7
+    for attempt in range(10):
+        i = AnnoyIndex(f, "euclidean")
+        for j in range(n):
+            i.add_item(j, numpy.random.normal(size=f))
+        i.build(n_trees, n_jobs=3)
+        i.save(fn)
+        i.load(fn)
+        assert n_trees == i.get_n_trees()
+
+
+def test_deterministic_build(tmp_path):
+    fn = str(tmp_path / "threads.ann")
+    n, f = 100000, 4
+    vectors = numpy.random.RandomState(0).normal(size=(n, f)).astype(numpy.float32)
+    hashes = set()
+    for n_jobs in [1, 3, 8]:
+        for n_trees in [5, -1]:
+            i = AnnoyIndex(f, "angular")
+            i.set_seed(1)
+            i.set_deterministic_build()
+            i.add_items(list(range(n)), vectors)
+            i.build(n_trees, n_jobs=n_jobs)
+            i.add_trees(2, n_jobs=n_jobs)
+            i.save(fn)
+            with open(fn, "rb") as fp:
+                hashes.add((n_trees, hashlib.md5(fp.read()).hexdigest()))
+    assert len(hashes) == 2
@@ -13,7 +13,10 @@
 # the License.
 
 import os
+import subprocess
+import sys
 
+import numpy
 import pytest
 
 from annoy import AnnoyIndex
@@ -50,3 +53,93 @@ def test_on_disk():
     j = AnnoyIndex(f, "euclidean")
     j.load("on_disk.ann")
     check_nns(j)
+
+
+def test_on_disk_build_from_file(tmp_path):
+    vectors_fn = str(tmp_path / "on_disk_vectors.raw")
+    fn = str(tmp_path / "on_disk.ann")
+    f = 2
+    numpy.array([[2, 2], [3, 2], [3, 3]], dtype=numpy.float32).tofile(vectors_fn)
+    i = AnnoyIndex(f, "euclidean")
+    i.on_disk_build(fn)
+    i.add_items_from_file(vectors_fn)
+    i.build(10)
+    check_nns(i)
+    i.unload()
+    i.load(fn)
+    check_nns(i)
+
+
+def test_on_disk_build_out_of_core(tmp_path):
+    f = 10
+    vectors = numpy.random.RandomState(0).normal(size=(20000, f)).astype(numpy.float32)
+    indexes = []
+    for memory in [0, 100000]:
+        i = AnnoyIndex(f, "euclidean")
+        i.set_seed(42)
+        i.set_split_sample_size(1000)
+        i.set_out_of_core_memory(memory)
+        i.on_disk_build(str(tmp_path / ("on_disk%d.ann" % memory)))
+        i.add_items(list(range(len(vectors))), vectors)
+        i.build(10, n_jobs=1)
+        indexes.append(i)
+
+    # The splits come from the same samples, so only the memory the items are read from differs
+    for j in range(0, 20000, 100):
+        assert indexes[0].get_nns_by_item(j, 10) == indexes[1].get_nns_by_item(j, 10)
+        assert indexes[1].get_nns_by_item(j, 1)[0] == j
+
+
+@pytest.mark.skipif(not sys.platform.startswith("linux"), reason="reads the heap size from /proc")
+def test_on_disk_build_trees_not_in_heap(tmp_path):
+    # The nodes of the trees go right into the file, so the build needs far less heap than the trees take
+    script = """
+import random, resource, sys
+from annoy import AnnoyIndex
+t = AnnoyIndex(8, "euclidean")
+t.on_disk_build(sys.argv[1])
+for i in range(50000):
+    t.add_item(i, [random.gauss(0, 1) for z in range(8)])
+heap = int([l.split()[1] for l in open("/proc/self/status") if l.startswith("VmData")][0]) * 1024
+resource.setrlimit(resource.RLIMIT_DATA, (heap + (16 << 20), resource.RLIM_INFINITY))
+t.build(100, n_jobs=1)
+t.unload()
+"""
+    fn = str(tmp_path / "on_disk.ann")
+    subprocess.check_call([sys.executable, "-c", script, fn])
+    assert os.path.getsize(fn) > 64 << 20  # The trees take more than the heap limit allows
+    i = AnnoyIndex(8, "euclidean")
+    i.load(fn)
+    assert i.get_n_trees() == 100
+    assert i.get_nns_by_item(0, 1) == [0]
+
+
+@pytest.mark.skipif(not sys.platform.startswith("linux"), reason="reads the heap size from /proc")
+def test_on_disk_build_loaded_index_not_in_heap(tmp_path):
+    # A loaded index is copied to the file of on_disk_build, and the trees merged into it are appended there
+    script = """
+import random, resource, sys
+from annoy import AnnoyIndex
+t = AnnoyIndex(8, "euclidean")
+t.on_disk_build(sys.argv[1])
+for i in range(50000):
+    t.add_item(i, [random.gauss(0, 1) for z in range(8)])
+t.build(50, n_jobs=1)
+t.unload()
+t.load(sys.argv[1])
+other = AnnoyIndex(8, "euclidean")
+other.load(sys.argv[1])
+heap = int([l.split()[1] for l in open("/proc/self/status") if l.startswith("VmData")][0]) * 1024
+resource.setrlimit(resource.RLIMIT_DATA, (heap + (16 << 20), resource.RLIM_INFINITY))
+t.on_disk_build(sys.argv[2])
+t.merge_trees(other)
+t.unload()
+"""
+    fn = str(tmp_path / "on_disk.ann")
+    merged_fn = str(tmp_path / "merged.ann")
+    subprocess.check_call([sys.executable, "-c", script, fn, merged_fn])
+    assert os.path.getsize(merged_fn) > 64 << 20
+    i = AnnoyIndex(8, "euclidean")
+    i.load(merged_fn)
+    assert i.get_n_trees() == 100
+    assert i.get_nns_by_item(0, 1) == [0]